@@ -17,12 +17,347 @@
 
 #include "redismodule.h"
 
+#include <errno.h>
+#include <limits.h>
 #include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <openssl/crypto.h>
+#include <openssl/ec.h>
+#include <openssl/obj_mac.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
 #include <themis/themis.h>
 
-static int scell_encrypt(RedisModuleCtx *ctx, RedisModuleString *key_name, const uint8_t* pass, size_t pass_len, const uint8_t* message, size_t message_len){
+/*
+ * Secure arena for plaintext and key material.
+ * Blocks are carved by size class from mlock'd pages excluded from core dumps
+ * and wiped on release. Every thread keeps a short cache of free blocks per
+ * class, the shared free lists are touched only when that cache runs dry or
+ * overflows. Requests above the largest class get mappings of their own,
+ * rounded up to a power of two; a few released ones of up to 8 MB are kept
+ * for reuse, larger ones are unmapped on release.
+ */
+#define SECURE_ARENA_CLASSES 8
+#define SECURE_ARENA_CHUNK_SIZE (1<<20)
+#define SECURE_ARENA_CHUNK_BLOCKS 4
+#define SECURE_ARENA_THREAD_CACHE 32
+#define SECURE_ARENA_THREAD_CACHE_BYTES (256*1024)
+#define SECURE_ARENA_LARGE_CACHE 8
+#define SECURE_ARENA_LARGE_CACHE_MAPPING (8<<20)
+#define SECURE_ARENA_LARGE_CACHE_BYTES (16<<20)
+
+static const size_t secure_arena_class_size[SECURE_ARENA_CLASSES]={64, 256, 1024, 4096, 16384, 65536, 262144, 1048576};
+
+//block header, sizes fit 32 bits as redis strings are limited to 512MB
+typedef struct secure_block_type{
+  uint32_t cls;
+  uint32_t locked;
+  uint32_t used;
+  uint32_t mapped;
+} secure_block_t;
+
+#define SECURE_ARENA_LARGE SECURE_ARENA_CLASSES
+
+typedef struct secure_arena_class_type{
+  pthread_mutex_t lock;
+  void* free_list;
+} secure_arena_class_t;
+
+typedef struct secure_thread_cache_type{
+  void* head[SECURE_ARENA_CLASSES];
+  size_t count[SECURE_ARENA_CLASSES];
+} secure_thread_cache_t;
+
+static secure_arena_class_t secure_arena[SECURE_ARENA_CLASSES]={
+  {PTHREAD_MUTEX_INITIALIZER, NULL}, {PTHREAD_MUTEX_INITIALIZER, NULL}, {PTHREAD_MUTEX_INITIALIZER, NULL}, {PTHREAD_MUTEX_INITIALIZER, NULL},
+  {PTHREAD_MUTEX_INITIALIZER, NULL}, {PTHREAD_MUTEX_INITIALIZER, NULL}, {PTHREAD_MUTEX_INITIALIZER, NULL}, {PTHREAD_MUTEX_INITIALIZER, NULL}
+};
+static pthread_key_t secure_thread_cache_key;
+static __thread secure_thread_cache_t* secure_thread_cache=NULL;
+
+static pthread_mutex_t secure_arena_large_lock=PTHREAD_MUTEX_INITIALIZER;
+static secure_block_t* secure_arena_large_cache[SECURE_ARENA_LARGE_CACHE];
+static size_t secure_arena_large_cached=0;
+static size_t secure_arena_large_cached_bytes=0;
+
+static size_t secure_arena_mapped_bytes=0;
+static size_t secure_arena_locked_bytes=0;
+static size_t secure_arena_used_bytes=0;
+static size_t secure_arena_used_blocks=0;
+
+#define STAT_ADD(stat, value) __atomic_add_fetch(&(stat), (value), __ATOMIC_RELAXED)
+#define STAT_SUB(stat, value) __atomic_sub_fetch(&(stat), (value), __ATOMIC_RELAXED)
+#define STAT_GET(stat) __atomic_load_n(&(stat), __ATOMIC_RELAXED)
+
+static void secure_zero(void* ptr, size_t len){
+  OPENSSL_cleanse(ptr, len);
+}
+
+static void* secure_map(size_t len, int* locked){
+  void* pages = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(MAP_FAILED == pages){
+    return NULL;
+  }
+#ifdef MADV_DONTDUMP
+  madvise(pages, len, MADV_DONTDUMP);
+#endif
+  //mlock may be refused by RLIMIT_MEMLOCK, pages are still usable then
+  *locked = (0 == mlock(pages, len));
+  if(*locked){
+    STAT_ADD(secure_arena_locked_bytes, len);
+  }
+  STAT_ADD(secure_arena_mapped_bytes, len);
+  return pages;
+}
+
+//munlock succeeds on pages that were never locked, so the caller says whether they were
+static void secure_unmap(void* pages, size_t len, int locked){
+  if(locked){
+    munlock(pages, len);
+    STAT_SUB(secure_arena_locked_bytes, len);
+  }
+  munmap(pages, len);
+  STAT_SUB(secure_arena_mapped_bytes, len);
+}
+
+static void secure_thread_cache_flush(void* arg){
+  secure_thread_cache_t *cache = arg;
+  size_t cls;
+  for(cls=0; cls<SECURE_ARENA_CLASSES; ++cls){
+    while(cache->head[cls]){
+      void* block = cache->head[cls];
+      cache->head[cls] = *(void**)block;
+      pthread_mutex_lock(&(secure_arena[cls].lock));
+      *(void**)block = secure_arena[cls].free_list;
+      secure_arena[cls].free_list = block;
+      pthread_mutex_unlock(&(secure_arena[cls].lock));
+    }
+  }
+  free(cache);
+}
+
+static secure_thread_cache_t* secure_thread_cache_get(void){
+  if(!secure_thread_cache){
+    secure_thread_cache = calloc(1, sizeof(secure_thread_cache_t));
+    if(secure_thread_cache){
+      pthread_setspecific(secure_thread_cache_key, secure_thread_cache);
+    }
+  }
+  return secure_thread_cache;
+}
+
+static int secure_arena_init(void){
+  return pthread_key_create(&secure_thread_cache_key, secure_thread_cache_flush);
+}
+
+//take a free block of class cls, refilling the shared list with a new chunk when empty
+static void* secure_arena_take(size_t cls){
+  secure_thread_cache_t *cache = secure_thread_cache_get();
+  void* block = NULL;
+  if(cache && cache->head[cls]){
+    block = cache->head[cls];
+    cache->head[cls] = *(void**)block;
+    --(cache->count[cls]);
+    return block;
+  }
+  pthread_mutex_lock(&(secure_arena[cls].lock));
+  if(!secure_arena[cls].free_list){
+    size_t stride = sizeof(secure_block_t)+secure_arena_class_size[cls], i;
+    size_t chunk_size = SECURE_ARENA_CHUNK_SIZE;
+    int locked=0;
+    if(chunk_size<SECURE_ARENA_CHUNK_BLOCKS*stride){
+      chunk_size = SECURE_ARENA_CHUNK_BLOCKS*stride;
+    }
+    //chunks are never unmapped, their lock state is only accounted once
+    uint8_t* chunk = secure_map(chunk_size, &locked);
+    if(!chunk){
+      pthread_mutex_unlock(&(secure_arena[cls].lock));
+      return NULL;
+    }
+    for(i=0; i+stride<=chunk_size; i+=stride){
+      *(void**)(chunk+i) = secure_arena[cls].free_list;
+      secure_arena[cls].free_list = chunk+i;
+    }
+  }
+  block = secure_arena[cls].free_list;
+  secure_arena[cls].free_list = *(void**)block;
+  pthread_mutex_unlock(&(secure_arena[cls].lock));
+  return block;
+}
+
+static void secure_arena_give(size_t cls, void* block){
+  secure_thread_cache_t *cache = secure_thread_cache_get();
+  //large classes keep fewer blocks per thread, at most SECURE_ARENA_THREAD_CACHE_BYTES
+  size_t limit = SECURE_ARENA_THREAD_CACHE_BYTES/secure_arena_class_size[cls];
+  if(limit>SECURE_ARENA_THREAD_CACHE){
+    limit = SECURE_ARENA_THREAD_CACHE;
+  }
+  if(cache && cache->count[cls]<(limit?limit:1)){
+    *(void**)block = cache->head[cls];
+    cache->head[cls] = block;
+    ++(cache->count[cls]);
+    return;
+  }
+  pthread_mutex_lock(&(secure_arena[cls].lock));
+  *(void**)block = secure_arena[cls].free_list;
+  secure_arena[cls].free_list = block;
+  pthread_mutex_unlock(&(secure_arena[cls].lock));
+}
+
+static secure_block_t* secure_arena_take_large(size_t size){
+  size_t mapped = SECURE_ARENA_CHUNK_SIZE, i;
+  int locked=0;
+  while(mapped<sizeof(secure_block_t)+size){
+    mapped <<= 1;
+  }
+  if(mapped>UINT32_MAX){
+    return NULL;
+  }
+  pthread_mutex_lock(&secure_arena_large_lock);
+  for(i=0; i<secure_arena_large_cached; ++i){
+    secure_block_t *block = secure_arena_large_cache[i];
+    if(mapped == block->mapped){
+      secure_arena_large_cache[i] = secure_arena_large_cache[--secure_arena_large_cached];
+      secure_arena_large_cached_bytes -= mapped;
+      pthread_mutex_unlock(&secure_arena_large_lock);
+      return block;
+    }
+  }
+  pthread_mutex_unlock(&secure_arena_large_lock);
+  secure_block_t *block = secure_map(mapped, &locked);
+  if(block){
+    block->locked = locked;
+    block->mapped = mapped;
+  }
+  return block;
+}
+
+static void secure_arena_give_large(secure_block_t* block){
+  pthread_mutex_lock(&secure_arena_large_lock);
+  if(secure_arena_large_cached<SECURE_ARENA_LARGE_CACHE && block->mapped<=SECURE_ARENA_LARGE_CACHE_MAPPING
+     && secure_arena_large_cached_bytes+block->mapped<=SECURE_ARENA_LARGE_CACHE_BYTES){
+    secure_arena_large_cache[secure_arena_large_cached++] = block;
+    secure_arena_large_cached_bytes += block->mapped;
+    pthread_mutex_unlock(&secure_arena_large_lock);
+    return;
+  }
+  pthread_mutex_unlock(&secure_arena_large_lock);
+  secure_unmap(block, block->mapped, block->locked);
+}
+
+static void* secure_alloc(size_t size){
+  secure_block_t *block = NULL;
+  size_t cls;
+  for(cls=0; cls<SECURE_ARENA_CLASSES && secure_arena_class_size[cls]<size; ++cls);
+  if(cls<SECURE_ARENA_CLASSES){
+    block = secure_arena_take(cls);
+    if(!block){
+      return NULL;
+    }
+    STAT_ADD(secure_arena_used_bytes, secure_arena_class_size[cls]);
+  } else {
+    block = secure_arena_take_large(size);
+    if(!block){
+      return NULL;
+    }
+    STAT_ADD(secure_arena_used_bytes, block->mapped);
+  }
+  STAT_ADD(secure_arena_used_blocks, 1);
+  block->cls = cls;
+  block->used = size;
+  return block+1;
+}
+
+//wipe only the requested part of the block, the rest was never handed out
+static void secure_free(void* ptr){
+  if(!ptr){
+    return;
+  }
+  secure_block_t *block = ((secure_block_t*)ptr)-1;
+  secure_zero(ptr, block->used);
+  STAT_SUB(secure_arena_used_blocks, 1);
+  if(SECURE_ARENA_LARGE == block->cls){
+    STAT_SUB(secure_arena_used_bytes, block->mapped);
+    secure_arena_give_large(block);
+    return;
+  }
+  STAT_SUB(secure_arena_used_bytes, secure_arena_class_size[block->cls]);
+  secure_arena_give(block->cls, block);
+}
+
+static uint8_t* secure_copy(const uint8_t* data, size_t data_len){
+  uint8_t* copy = secure_alloc(data_len);
+  if(copy){
+    memcpy(copy, data, data_len);
+  }
+  return copy;
+}
+
+/*
+ * Context imprint storage: length-preserving secure cell with the key name as
+ * context, no authentication. Such values are prefixed with a one byte marker,
+ * sealed values can't start with it as they begin with the low byte of the
+ * themis algorithm id, which is always zero.
+ */
+#define SCELL_IMPRINT_MARKER 0xC1
+
+//per-write counters, overwritten or deleted values are not subtracted
+static size_t scell_imprint_values=0;
+static size_t scell_imprint_bytes_saved_written=0;
+
+static int scell_imprint_encrypt(RedisModuleCtx *ctx, RedisModuleString *key_name, const uint8_t* pass, size_t pass_len, const uint8_t* message, size_t message_len){
+  size_t context_len=0, encrypted_data_len=0, seal_len=0;
+  const uint8_t *context = (const uint8_t*)RedisModule_StringPtrLen(key_name, &context_len);
+  if(THEMIS_BUFFER_TOO_SMALL!=themis_secure_cell_encrypt_context_imprint(pass, pass_len, message, message_len, context, context_len, NULL, &encrypted_data_len)){
+    return -1;
+  }
+  RedisModuleKey *key = RedisModule_OpenKey(ctx, key_name, REDISMODULE_WRITE);
+  if(REDISMODULE_OK != RedisModule_StringTruncate(key, 1+encrypted_data_len)){
+    RedisModule_DeleteKey(key);
+    RedisModule_CloseKey(key);
+    return -1;
+  }
+  size_t value_len=0;
+  uint8_t* value = (uint8_t*)(RedisModule_StringDMA(key, &value_len, REDISMODULE_WRITE));
+  value[0] = SCELL_IMPRINT_MARKER;
+  if(THEMIS_SUCCESS!=themis_secure_cell_encrypt_context_imprint(pass, pass_len, message, message_len, context, context_len, value+1, &encrypted_data_len)){
+    RedisModule_DeleteKey(key);
+    RedisModule_CloseKey(key);
+    return -1;
+  }
+  RedisModule_CloseKey(key);
+  //the seal length query only computes sizes
+  if(THEMIS_BUFFER_TOO_SMALL==themis_secure_cell_encrypt_seal(pass, pass_len, NULL, 0, message, message_len, NULL, &seal_len) && seal_len>value_len){
+    STAT_ADD(scell_imprint_bytes_saved_written, seal_len-value_len);
+  }
+  STAT_ADD(scell_imprint_values, 1);
+  return 0;
+}
+
+static int scell_imprint_open(const uint8_t* context, size_t context_len, const uint8_t* pass, size_t pass_len, const uint8_t* message, size_t message_len, uint8_t** decrypted_data, size_t* decrypted_data_len){
+    if(THEMIS_BUFFER_TOO_SMALL!=themis_secure_cell_decrypt_context_imprint(pass, pass_len, message, message_len, context, context_len, NULL, decrypted_data_len)){
+      return -1;
+    }
+    *decrypted_data = secure_alloc(*decrypted_data_len);
+    if(!(*decrypted_data)){
+      return -1;
+    }
+    if(THEMIS_SUCCESS!=themis_secure_cell_decrypt_context_imprint(pass, pass_len, message, message_len, context, context_len, *decrypted_data, decrypted_data_len)){
+      secure_free(*decrypted_data);
+      return -1;
+    }
+    return 0;
+}
+
+static int scell_encrypt(RedisModuleCtx *ctx, RedisModuleString *key_name, const uint8_t* pass, size_t pass_len, const uint8_t* message, size_t message_len, int imprint){
   size_t encrypted_data_len=0;
+  if(imprint){
+    return scell_imprint_encrypt(ctx, key_name, pass, pass_len, message, message_len);
+  }
   if(THEMIS_BUFFER_TOO_SMALL!=themis_secure_cell_encrypt_seal(pass, pass_len, NULL, 0, message, message_len, NULL, &encrypted_data_len)){
     return -1;      
   }
@@ -43,6 +378,22 @@ static int scell_encrypt(RedisModuleCtx *ctx, RedisModuleString *key_name, const
   return 0;
 }
 
+//decrypt secure cell sealed buffer into newly allocated plaintext, caller frees it
+static int scell_open(const uint8_t* pass, size_t pass_len, const uint8_t* message, size_t message_len, uint8_t** decrypted_data, size_t* decrypted_data_len){
+    if(THEMIS_BUFFER_TOO_SMALL!=themis_secure_cell_decrypt_seal(pass, pass_len, NULL, 0, message, message_len, NULL, decrypted_data_len)){
+      return -1;
+    }
+    *decrypted_data = secure_alloc(*decrypted_data_len);
+    if(!(*decrypted_data)){
+      return -1;
+    }
+    if(THEMIS_SUCCESS!=themis_secure_cell_decrypt_seal(pass, pass_len, NULL, 0, message, message_len, *decrypted_data, decrypted_data_len)){
+      secure_free(*decrypted_data);
+      return -1;
+    }
+    return 0;
+}
+
 static int scell_decrypt(RedisModuleCtx *ctx, RedisModuleString *key_name, const uint8_t* pass, size_t pass_len, uint8_t** decrypted_data, size_t* decrypted_data_len){
     RedisModuleKey *key = RedisModule_OpenKey(ctx, key_name, REDISMODULE_READ);
     if(NULL == key){
@@ -56,33 +407,40 @@ static int scell_decrypt(RedisModuleCtx *ctx, RedisModuleString *key_name, const
 
     size_t message_len=0;
     const uint8_t *message=(const uint8_t*)(RedisModule_StringDMA(key, &message_len, REDISMODULE_READ));
-    if(THEMIS_BUFFER_TOO_SMALL!=themis_secure_cell_decrypt_seal(pass, pass_len, NULL, 0, message, message_len, NULL, decrypted_data_len)){
-      RedisModule_CloseKey(key);
-      return -1;
-    }
-    *decrypted_data = malloc(*decrypted_data_len);
-    if(!(*decrypted_data)){
-      RedisModule_CloseKey(key);
-      return -1;
-    }
-    if(THEMIS_SUCCESS!=themis_secure_cell_decrypt_seal(pass, pass_len, NULL, 0, message, message_len, *decrypted_data, decrypted_data_len)){
-      RedisModule_CloseKey(key);      
-      free(*decrypted_data);
-      return -1;
+    int res;
+    if(message_len>1 && SCELL_IMPRINT_MARKER == message[0]){
+      size_t context_len=0;
+      const uint8_t *context = (const uint8_t*)RedisModule_StringPtrLen(key_name, &context_len);
+      res = scell_imprint_open(context, context_len, pass, pass_len, message+1, message_len-1, decrypted_data, decrypted_data_len);
+    } else {
+      res = scell_open(pass, pass_len, message, message_len, decrypted_data, decrypted_data_len);
     }
     RedisModule_CloseKey(key);
+    return res;
+}
+
+//cset key password data [IMPRINT]
+static int scell_imprint_option(RedisModuleString **argv, int argc){
+  if(5 != argc){
     return 0;
+  }
+  return (0 == strcasecmp(RedisModule_StringPtrLen(argv[4], NULL), "imprint"))?1:-1;
 }
 
 static int cmd_scell_seal_encrypt(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    if (argc != 4) {
+    if (argc != 4 && argc != 5) {
         RedisModule_WrongArity(ctx);
         return REDISMODULE_ERR;
     }
+    int imprint = scell_imprint_option(argv, argc);
+    if(imprint<0){
+      RedisModule_ReplyWithError(ctx, "ERR syntax error");
+      return REDISMODULE_ERR;
+    }
     size_t pass_len=0, message_len=0;
     const uint8_t *pass = (const uint8_t*)RedisModule_StringPtrLen(argv[2], &pass_len);
     const uint8_t *message = (const uint8_t*)RedisModule_StringPtrLen(argv[3], &message_len);
-    if(0 != scell_encrypt(ctx, argv[1], pass, pass_len, message, message_len)){
+    if(0 != scell_encrypt(ctx, argv[1], pass, pass_len, message, message_len, imprint)){
       RedisModule_ReplyWithError(ctx, "ERR secure seal encryption failed");
       return REDISMODULE_ERR;      
     }
@@ -109,7 +467,7 @@ static int cmd_scell_seal_decrypt(RedisModuleCtx *ctx, RedisModuleString **argv,
       return REDISMODULE_ERR;
     case 0:
       RedisModule_ReplyWithStringBuffer(ctx, (const char*)decrypted_data, decrypted_data_len);
-      free(decrypted_data);
+      secure_free(decrypted_data);
       return REDISMODULE_OK;
     }
       RedisModule_ReplyWithError(ctx, "ERR secure seal decryption failed");
@@ -134,26 +492,33 @@ void* scell_enc_thread(void* arg){
   RedisModuleCtx *ctx = targ[0];
   RedisModuleBlockedClient *bc = targ[1];
   RedisModuleString **argv = (RedisModuleString **)targ[2];
+  int imprint = (long)targ[3];
   RedisModule_Free(targ);
   size_t pass_len=0, message_len=0;
   const uint8_t *pass = (const uint8_t*)RedisModule_StringPtrLen(argv[2], &pass_len);
   const uint8_t *message = (const uint8_t*)RedisModule_StringPtrLen(argv[3], &message_len);
-  long res = scell_encrypt(ctx, argv[1], pass, pass_len, message, message_len);
+  long res = scell_encrypt(ctx, argv[1], pass, pass_len, message, message_len, imprint);
   RedisModule_UnblockClient(bc,(void*)res);
   return NULL;
 }
 
 static int cmd_scell_seal_encrypt_block(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    if (argc != 4) {
+    if (argc != 4 && argc != 5) {
         RedisModule_WrongArity(ctx);
         return REDISMODULE_ERR;
     }
+    int imprint = scell_imprint_option(argv, argc);
+    if(imprint<0){
+      RedisModule_ReplyWithError(ctx, "ERR syntax error");
+      return REDISMODULE_ERR;
+    }
     pthread_t tid;
     RedisModuleBlockedClient *bc = RedisModule_BlockClient(ctx, scell_enc_reply, scell_enc_timeout, NULL, 2000);
     void **targ = RedisModule_Alloc(sizeof(void*)*4);
     targ[0] = ctx;
     targ[1] = bc;
     targ[2] = (void*)argv;
+    targ[3] = (void*)(long)imprint;
     if (pthread_create(&tid,NULL,scell_enc_thread,(void*)targ) != 0) {
       RedisModule_AbortBlock(bc);
       return RedisModule_ReplyWithError(ctx,"-ERR Can't start thread");
@@ -179,6 +544,10 @@ int scell_dec_timeout(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
 }
 
 void scell_dec_free(void *privdata) {
+  void** res = privdata;
+  if(0 == (long)(res[0])){
+    secure_free(res[1]);
+  }
   RedisModule_Free(privdata);
 }
 void* scell_dec_thread(void* arg){
@@ -252,36 +621,257 @@ static int smessage_decrypt(const uint8_t* data, const uint32_t data_length, con
   if(THEMIS_BUFFER_TOO_SMALL!=themis_secure_message_unwrap(private_key, private_key_length, public_key, public_key_length, data_, data_length_, NULL, (size_t*)dec_data_length)){
     return -1;
   }
-  *dec_data = malloc(*dec_data_length);
+  *dec_data = secure_alloc(*dec_data_length);
   if(!(*dec_data)){
     return -2;
   }
   if(THEMIS_SUCCESS!=themis_secure_message_unwrap(private_key, private_key_length, public_key, public_key_length, data_, data_length_, *dec_data, (size_t*)dec_data_length)){
-    free(*dec_data);
+    secure_free(*dec_data);
+    return -1;
+  }
+  return 0;
+}
+
+//ephemeral EC key pair sizes, a size query makes soter generate a whole key pair so it is done once at load
+static size_t smessage_private_key_length=0;
+static size_t smessage_public_key_length=0;
+
+static int smessage_key_sizes_init(void){
+  if(THEMIS_BUFFER_TOO_SMALL!=themis_gen_ec_key_pair(NULL, &smessage_private_key_length, NULL, &smessage_public_key_length)){
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Multi-recipient container: payload is sealed once with a random data key,
+ * only the data key is wrapped with secure message for every recipient.
+ * "RTMR" | uint32 ephemeral public key length | ephemeral public key |
+ * uint32 recipients | recipients x (fingerprint[8] | uint32 wrapped key length | wrapped key) |
+ * secure cell sealed payload
+ * Fingerprint is the first 8 bytes of SHA-256 over the compressed EC point of
+ * the recipient key, so msget finds its slot from the private key alone.
+ */
+#define SMESSAGE_MULTI_MAGIC "RTMR"
+#define SMESSAGE_MULTI_MAGIC_LEN 4
+#define SMESSAGE_FINGERPRINT_LEN 8
+#define SMESSAGE_DATA_KEY_LEN 32
+#define THEMIS_KEY_HEADER_LEN 12
+
+static int themis_key_curve(const uint8_t* key, size_t key_len){
+  if(key_len<=THEMIS_KEY_HEADER_LEN || 'E'!=key[1] || 'C'!=key[2]){
+    return NID_undef;
+  }
+  switch(key[3]){
+  case '2':
+    return NID_X9_62_prime256v1;
+  case '3':
+    return NID_secp384r1;
+  case '5':
+    return NID_secp521r1;
+  }
+  return NID_undef;
+}
+
+static void ec_point_fingerprint(const uint8_t* point, size_t point_len, uint8_t* fingerprint){
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+  SHA256(point, point_len, digest);
+  memcpy(fingerprint, digest, SMESSAGE_FINGERPRINT_LEN);
+}
+
+static int public_key_fingerprint(const uint8_t* public_key, size_t public_key_len, uint8_t* fingerprint){
+  if(NID_undef == themis_key_curve(public_key, public_key_len) || 'U'!=public_key[0]){
     return -1;
   }
+  ec_point_fingerprint(public_key+THEMIS_KEY_HEADER_LEN, public_key_len-THEMIS_KEY_HEADER_LEN, fingerprint);
   return 0;
 }
 
-static int smessage_dec(const uint8_t* private_key, const uint32_t private_key_length, const uint8_t* data, const uint8_t data_length, uint8_t** dec_data, uint32_t* dec_data_length){
+//derive compressed public point from themis private key and fingerprint it
+static int private_key_fingerprint(const uint8_t* private_key, size_t private_key_len, uint8_t* fingerprint){
+  int nid = themis_key_curve(private_key, private_key_len), res=-1;
+  if(NID_undef == nid || 'R'!=private_key[0]){
+    return -1;
+  }
+  EC_GROUP *group = EC_GROUP_new_by_curve_name(nid);
+  BIGNUM *d = BN_bin2bn(private_key+THEMIS_KEY_HEADER_LEN, private_key_len-THEMIS_KEY_HEADER_LEN, NULL);
+  EC_POINT *q = group?EC_POINT_new(group):NULL;
+  uint8_t point[1+66];
+  size_t point_len=0;
+  if(group && d && q && EC_POINT_mul(group, q, d, NULL, NULL, NULL)){
+    point_len = EC_POINT_point2oct(group, q, POINT_CONVERSION_COMPRESSED, point, sizeof(point), NULL);
+    if(point_len){
+      ec_point_fingerprint(point, point_len, fingerprint);
+      res=0;
+    }
+  }
+  EC_POINT_free(q);
+  BN_clear_free(d);
+  EC_GROUP_free(group);
+  return res;
+}
+
+static int smessage_multi_e(RedisModuleCtx *ctx, RedisModuleString *key_name, RedisModuleString **public_keys, size_t count, const uint8_t* message, size_t message_len){
+    size_t new_private_key_length=smessage_private_key_length, new_public_key_length=smessage_public_key_length, sealed_len=0, total_len, i;
+    uint32_t field;
+    int res=-1;
+    //data key and ephemeral key pair live in one arena block
+    uint8_t* data_key = secure_alloc(SMESSAGE_DATA_KEY_LEN+new_private_key_length+new_public_key_length);
+    if(!data_key){
+      return -1;
+    }
+    uint8_t* new_private_key = data_key+SMESSAGE_DATA_KEY_LEN;
+    uint8_t* new_public_key = new_private_key+new_private_key_length;
+    uint8_t* fingerprints = RedisModule_Calloc(count, SMESSAGE_FINGERPRINT_LEN);
+    uint8_t** wrapped = RedisModule_Calloc(count, sizeof(uint8_t*));
+    size_t* wrapped_len = RedisModule_Calloc(count, sizeof(size_t));
+    if(1 != RAND_bytes(data_key, SMESSAGE_DATA_KEY_LEN)
+       || THEMIS_SUCCESS!=themis_gen_ec_key_pair(new_private_key, &new_private_key_length, new_public_key, &new_public_key_length)
+       || THEMIS_BUFFER_TOO_SMALL!=themis_secure_cell_encrypt_seal(data_key, SMESSAGE_DATA_KEY_LEN, NULL, 0, message, message_len, NULL, &sealed_len)){
+      goto cleanup;
+    }
+    total_len = SMESSAGE_MULTI_MAGIC_LEN+sizeof(field)+new_public_key_length+sizeof(field)+sealed_len;
+    for(i=0; i<count; ++i){
+      size_t public_key_len=0;
+      const uint8_t *public_key = (const uint8_t*)RedisModule_StringPtrLen(public_keys[i], &public_key_len);
+      if(0 != public_key_fingerprint(public_key, public_key_len, fingerprints+i*SMESSAGE_FINGERPRINT_LEN)
+         || THEMIS_BUFFER_TOO_SMALL!=themis_secure_message_wrap(new_private_key, new_private_key_length, public_key, public_key_len, data_key, SMESSAGE_DATA_KEY_LEN, NULL, &(wrapped_len[i]))){
+        goto cleanup;
+      }
+      wrapped[i] = RedisModule_Alloc(wrapped_len[i]);
+      if(THEMIS_SUCCESS!=themis_secure_message_wrap(new_private_key, new_private_key_length, public_key, public_key_len, data_key, SMESSAGE_DATA_KEY_LEN, wrapped[i], &(wrapped_len[i]))){
+        goto cleanup;
+      }
+      total_len += SMESSAGE_FINGERPRINT_LEN+sizeof(field)+wrapped_len[i];
+    }
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, key_name, REDISMODULE_WRITE);
+    if(REDISMODULE_OK != RedisModule_StringTruncate(key, total_len)){
+      RedisModule_DeleteKey(key);
+      RedisModule_CloseKey(key);
+      goto cleanup;
+    }
+    uint8_t* out = (uint8_t*)(RedisModule_StringDMA(key, &total_len, REDISMODULE_WRITE));
+    memcpy(out, SMESSAGE_MULTI_MAGIC, SMESSAGE_MULTI_MAGIC_LEN);
+    out += SMESSAGE_MULTI_MAGIC_LEN;
+    field = new_public_key_length;
+    memcpy(out, &field, sizeof(field));
+    memcpy(out+sizeof(field), new_public_key, new_public_key_length);
+    out += sizeof(field)+new_public_key_length;
+    field = count;
+    memcpy(out, &field, sizeof(field));
+    out += sizeof(field);
+    for(i=0; i<count; ++i){
+      memcpy(out, fingerprints+i*SMESSAGE_FINGERPRINT_LEN, SMESSAGE_FINGERPRINT_LEN);
+      field = wrapped_len[i];
+      memcpy(out+SMESSAGE_FINGERPRINT_LEN, &field, sizeof(field));
+      memcpy(out+SMESSAGE_FINGERPRINT_LEN+sizeof(field), wrapped[i], wrapped_len[i]);
+      out += SMESSAGE_FINGERPRINT_LEN+sizeof(field)+wrapped_len[i];
+    }
+    if(THEMIS_SUCCESS!=themis_secure_cell_encrypt_seal(data_key, SMESSAGE_DATA_KEY_LEN, NULL, 0, message, message_len, out, &sealed_len)){
+      RedisModule_DeleteKey(key);
+      RedisModule_CloseKey(key);
+      goto cleanup;
+    }
+    RedisModule_CloseKey(key);
+    res=0;
+cleanup:
+    for(i=0; i<count; ++i){
+      if(wrapped[i]){
+        RedisModule_Free(wrapped[i]);
+      }
+    }
+    RedisModule_Free(wrapped);
+    RedisModule_Free(wrapped_len);
+    RedisModule_Free(fingerprints);
+    secure_free(data_key);
+    return res;
+}
+
+//decrypt multi-recipient container, slot is picked by fingerprint, all slots are tried if it can't be derived
+static int smessage_multi_decrypt(const uint8_t* data, const uint32_t data_length, const uint8_t* private_key, const uint32_t private_key_length, uint8_t** dec_data, uint32_t* dec_data_length){
+  uint8_t fingerprint[SMESSAGE_FINGERPRINT_LEN];
+  int has_fingerprint = (0 == private_key_fingerprint(private_key, private_key_length, fingerprint));
+  uint32_t public_key_length=0, count=0, wrapped_length=0, i;
+  size_t offset = SMESSAGE_MULTI_MAGIC_LEN, payload_offset, data_key_length=0, decrypted_length=0;
+  const uint8_t* public_key;
+  if(data_length<offset+sizeof(public_key_length)){
+    return -1;
+  }
+  memcpy(&public_key_length, data+offset, sizeof(public_key_length));
+  offset += sizeof(public_key_length);
+  if(data_length-offset<(size_t)public_key_length+sizeof(count)){
+    return -1;
+  }
+  public_key = data+offset;
+  offset += public_key_length;
+  memcpy(&count, data+offset, sizeof(count));
+  offset += sizeof(count);
+  //skip over the slots to find the payload
+  payload_offset = offset;
+  for(i=0; i<count; ++i){
+    if(data_length-payload_offset<SMESSAGE_FINGERPRINT_LEN+sizeof(wrapped_length)){
+      return -1;
+    }
+    memcpy(&wrapped_length, data+payload_offset+SMESSAGE_FINGERPRINT_LEN, sizeof(wrapped_length));
+    payload_offset += SMESSAGE_FINGERPRINT_LEN+sizeof(wrapped_length);
+    if(data_length-payload_offset<wrapped_length){
+      return -1;
+    }
+    payload_offset += wrapped_length;
+  }
+  uint8_t* data_key = secure_alloc(SMESSAGE_DATA_KEY_LEN);
+  if(!data_key){
+    return -2;
+  }
+  for(i=0; i<count; offset+=SMESSAGE_FINGERPRINT_LEN+sizeof(wrapped_length)+wrapped_length, ++i){
+    memcpy(&wrapped_length, data+offset+SMESSAGE_FINGERPRINT_LEN, sizeof(wrapped_length));
+    if(has_fingerprint && 0 != memcmp(fingerprint, data+offset, SMESSAGE_FINGERPRINT_LEN)){
+      continue;
+    }
+    data_key_length = SMESSAGE_DATA_KEY_LEN;
+    if(THEMIS_SUCCESS==themis_secure_message_unwrap(private_key, private_key_length, public_key, public_key_length, data+offset+SMESSAGE_FINGERPRINT_LEN+sizeof(wrapped_length), wrapped_length, data_key, &data_key_length)){
+      break;
+    }
+  }
+  if(i == count){
+    secure_free(data_key);
+    return -1;
+  }
+  int res = scell_open(data_key, data_key_length, data+payload_offset, data_length-payload_offset, dec_data, &decrypted_length);
+  secure_free(data_key);
+  *dec_data_length = decrypted_length;
+  return res;
+}
+
+static int smessage_dec(const uint8_t* private_key, const uint32_t private_key_length, const uint8_t* data, const uint32_t data_length, uint8_t** dec_data, uint32_t* dec_data_length){
+  if(data_length>=SMESSAGE_MULTI_MAGIC_LEN && 0 == memcmp(data, SMESSAGE_MULTI_MAGIC, SMESSAGE_MULTI_MAGIC_LEN)){
+    return smessage_multi_decrypt(data, data_length, private_key, private_key_length, dec_data, dec_data_length);
+  }
   return smessage_decrypt(data, data_length, private_key, private_key_length, dec_data, dec_data_length);
 }
 
 static int smessage_e(RedisModuleCtx *ctx, RedisModuleString *key_name, const uint8_t* public_key, size_t public_key_len, const uint8_t* message, size_t message_len){
-    uint8_t new_private_key[10240];
-    uint8_t new_public_key[10240];
-    size_t new_private_key_length=10240, new_public_key_length=10240;
+    size_t new_private_key_length=smessage_private_key_length, new_public_key_length=smessage_public_key_length;
+    //ephemeral key pair lives in one arena block, private part first
+    uint8_t* new_private_key = secure_alloc(new_private_key_length+new_public_key_length);
+    if(!new_private_key){
+      return -1;
+    }
+    uint8_t* new_public_key = new_private_key+new_private_key_length;
     if(THEMIS_SUCCESS!=themis_gen_ec_key_pair(new_private_key, &new_private_key_length, new_public_key, &new_public_key_length)){
+      secure_free(new_private_key);
       return -1;      
     }
     size_t encrypted_data_len = smessage_encrypt_len((const uint8_t*)message, message_len, new_private_key, new_private_key_length,  new_public_key, new_public_key_length, (const uint8_t*)public_key, public_key_len);
     if(0==encrypted_data_len){
+      secure_free(new_private_key);
       return -1;            
     }
     RedisModuleKey *key = RedisModule_OpenKey(ctx, key_name, REDISMODULE_WRITE);
     if(REDISMODULE_OK != RedisModule_StringTruncate(key, encrypted_data_len)){
       RedisModule_DeleteKey(key);
       RedisModule_CloseKey(key);
+      secure_free(new_private_key);
       return -1;            
     }
     uint8_t* encrypted_data = (uint8_t*)(RedisModule_StringDMA(key, &encrypted_data_len, REDISMODULE_WRITE));
@@ -289,21 +879,31 @@ static int smessage_e(RedisModuleCtx *ctx, RedisModuleString *key_name, const ui
     if(0 != smessage_encrypt((const uint8_t*)message, message_len, new_private_key, new_private_key_length, new_public_key, new_public_key_length, (const uint8_t*)public_key, public_key_len, encrypted_data, (uint32_t*)(&encrypted_data_len))){
       RedisModule_DeleteKey(key);
       RedisModule_CloseKey(key);
+      secure_free(new_private_key);
       return -1;      
     }
     RedisModule_CloseKey(key);
+    secure_free(new_private_key);
     return 0;  
 }
 
+//msset key public_key [public_key ...] data, single recipient keeps the acra struct
+static int smessage_set(RedisModuleCtx *ctx, RedisModuleString **argv, int argc){
+    size_t public_key_len=0, message_len=0;
+    const uint8_t *message = (const uint8_t*)RedisModule_StringPtrLen(argv[argc-1], &message_len);
+    if(4 == argc){
+      const uint8_t *public_key = (const uint8_t*)RedisModule_StringPtrLen(argv[2], &public_key_len);
+      return smessage_e(ctx, argv[1], public_key, public_key_len, message, message_len);
+    }
+    return smessage_multi_e(ctx, argv[1], argv+2, argc-3, message, message_len);
+}
+
 static int cmd_smessage_encrypt(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    if (argc != 4) {
+    if (argc < 4) {
         RedisModule_WrongArity(ctx);
         return REDISMODULE_OK;
     }
-    size_t public_key_len=0, message_len=0;
-    const uint8_t *public_key = (const uint8_t*)RedisModule_StringPtrLen(argv[2], &public_key_len);
-    const uint8_t *message = (const uint8_t*)RedisModule_StringPtrLen(argv[3], &message_len);
-    int res = smessage_e(ctx, argv[1], public_key, public_key_len, message, message_len);
+    int res = smessage_set(ctx, argv, argc);
     switch(res){
     case 0:
       RedisModule_ReplyWithSimpleString(ctx, "OK");
@@ -331,17 +931,15 @@ void* smessage_enc_thread(void* arg){
   RedisModuleCtx *ctx = targ[0];
   RedisModuleBlockedClient *bc = targ[1];
   RedisModuleString **argv = (RedisModuleString **)targ[2];
+  int argc = (long)targ[3];
   RedisModule_Free(targ);
-  size_t pass_len=0, message_len=0;
-  const uint8_t *pass = (const uint8_t*)RedisModule_StringPtrLen(argv[2], &pass_len);
-  const uint8_t *message = (const uint8_t*)RedisModule_StringPtrLen(argv[3], &message_len);
-  long res = smessage_e(ctx, argv[1], pass, pass_len, message, message_len);
+  long res = smessage_set(ctx, argv, argc);
   RedisModule_UnblockClient(bc,(void*)res);
   return NULL;
 }
 
 static int cmd_smessage_encrypt_block(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    if (argc != 4) {
+    if (argc < 4) {
         RedisModule_WrongArity(ctx);
         return REDISMODULE_ERR;
     }
@@ -351,6 +949,7 @@ static int cmd_smessage_encrypt_block(RedisModuleCtx *ctx, RedisModuleString **a
     targ[0] = ctx;
     targ[1] = bc;
     targ[2] = (void*)argv;
+    targ[3] = (void*)(long)argc;
     if (pthread_create(&tid,NULL,smessage_enc_thread,(void*)targ) != 0) {
       RedisModule_AbortBlock(bc);
       return RedisModule_ReplyWithError(ctx,"-ERR Can't start thread");
@@ -398,7 +997,7 @@ static int cmd_smessage_decrypt(RedisModuleCtx *ctx, RedisModuleString **argv, i
       return REDISMODULE_ERR;
     case 0:
       RedisModule_ReplyWithStringBuffer(ctx, (const char*)decrypted_data, decrypted_data_len);
-      free(decrypted_data);
+      secure_free(decrypted_data);
       return REDISMODULE_OK;
     }
     RedisModule_ReplyWithError(ctx, "ERR secure message decryption failed");
@@ -423,6 +1022,10 @@ int smessage_dec_timeout(RedisModuleCtx *ctx, RedisModuleString **argv, int argc
 }
 
 void smessage_dec_free(void *privdata) {
+  void** res = privdata;
+  if(0 == (long)(res[0])){
+    secure_free(res[1]);
+  }
   RedisModule_Free(privdata);
 }
 void* smessage_dec_thread(void* arg){
@@ -459,25 +1062,1315 @@ static int cmd_smessage_decrypt_block(RedisModuleCtx *ctx, RedisModuleString **a
   return REDISMODULE_OK;    
 }
 
+//encrypt buffer with secure cell seal into newly allocated buffer, caller frees it
+static int scell_seal(const uint8_t* pass, size_t pass_len, const uint8_t* message, size_t message_len, uint8_t** encrypted_data, size_t* encrypted_data_len){
+    if(THEMIS_BUFFER_TOO_SMALL!=themis_secure_cell_encrypt_seal(pass, pass_len, NULL, 0, message, message_len, NULL, encrypted_data_len)){
+      return -1;
+    }
+    *encrypted_data = malloc(*encrypted_data_len);
+    if(!(*encrypted_data)){
+      return -1;
+    }
+    if(THEMIS_SUCCESS!=themis_secure_cell_encrypt_seal(pass, pass_len, NULL, 0, message, message_len, *encrypted_data, encrypted_data_len)){
+      free(*encrypted_data);
+      return -1;
+    }
+    return 0;
+}
 
-int RedisModule_OnLoad(RedisModuleCtx *ctx) {
-    if (RedisModule_Init(ctx, "rd_themis", 1, REDISMODULE_APIVER_1) == REDISMODULE_ERR)
-        return REDISMODULE_ERR;
-    if (RedisModule_CreateCommand(ctx, "rd_themis.cset", cmd_scell_seal_encrypt, "no-monitor fast", 1, 1, 1) == REDISMODULE_ERR)
-        return REDISMODULE_ERR;
-    if (RedisModule_CreateCommand(ctx, "rd_themis.cget", cmd_scell_seal_decrypt, "no-monitor fast", 1, 1, 1) == REDISMODULE_ERR)
-        return REDISMODULE_ERR;
-    if (RedisModule_CreateCommand(ctx, "rd_themis.csetbl", cmd_scell_seal_encrypt_block, "no-monitor fast", 1, 1, 1) == REDISMODULE_ERR)
-      return REDISMODULE_ERR;
-    if (RedisModule_CreateCommand(ctx, "rd_themis.cgetbl", cmd_scell_seal_decrypt_block, "no-monitor fast", 1, 1, 1) == REDISMODULE_ERR)
-      return REDISMODULE_ERR;
-    if (RedisModule_CreateCommand(ctx, "rd_themis.msset", cmd_smessage_encrypt, "no-monitor fast", 1, 1, 1) == REDISMODULE_ERR)
-      return REDISMODULE_ERR;
-    if (RedisModule_CreateCommand(ctx, "rd_themis.msget", cmd_smessage_decrypt, "no-monitor fast", 1, 1, 1) == REDISMODULE_ERR)
-      return REDISMODULE_ERR;
-    if (RedisModule_CreateCommand(ctx, "rd_themis.mssetbl", cmd_smessage_encrypt_block, "no-monitor fast", 1, 1, 1) == REDISMODULE_ERR)
-      return REDISMODULE_ERR;
-    if (RedisModule_CreateCommand(ctx, "rd_themis.msgetbl", cmd_smessage_decrypt_block, "no-monitor fast", 1, 1, 1) == REDISMODULE_ERR)
+/*
+ * Worker pool shared by all requests: RD_THEMIS_MAX_WORKERS threads started on
+ * first use, fed from one queue of batches. A batch runs job(arg, i) for every
+ * i in [0, count); workers claim items one by one, so several workers and the
+ * submitting thread can share a batch. The pool belongs to the process that
+ * started it, a forked child (BGSAVE) starts its own on first use.
+ * Submitting is done from the main thread only.
+ */
+#define RD_THEMIS_MAX_WORKERS 8
+#define RD_THEMIS_MIN_ITEMS_PER_WORKER 8
+
+typedef void (*parallel_job_t)(void* arg, size_t idx);
+typedef void (*parallel_done_t)(void* arg);
+
+typedef struct parallel_batch_type{
+  parallel_job_t job;
+  parallel_done_t done_cb;
+  void* arg;
+  size_t count;
+  size_t next;
+  size_t done;
+  size_t refs;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} parallel_batch_t;
+
+typedef struct parallel_task_type{
+  parallel_batch_t* batch;
+  struct parallel_task_type* next;
+} parallel_task_t;
+
+static pthread_mutex_t parallel_pool_lock=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t parallel_pool_cond=PTHREAD_COND_INITIALIZER;
+static parallel_task_t* parallel_pool_head=NULL;
+static parallel_task_t* parallel_pool_tail=NULL;
+static pthread_t parallel_pool_threads[RD_THEMIS_MAX_WORKERS];
+static size_t parallel_pool_size=0;
+static pid_t parallel_pool_pid=0;
+static int parallel_pool_stopping=0;
+
+static void parallel_batch_release(parallel_batch_t* batch){
+  if(0 == __atomic_sub_fetch(&(batch->refs), 1, __ATOMIC_ACQ_REL)){
+    pthread_mutex_destroy(&(batch->lock));
+    pthread_cond_destroy(&(batch->cond));
+    free(batch);
+  }
+}
+
+//claim and run items until none is left, whoever finishes the last one completes the batch
+static void parallel_batch_work(parallel_batch_t* batch){
+  size_t i;
+  while((i = __atomic_fetch_add(&(batch->next), 1, __ATOMIC_RELAXED)) < batch->count){
+    batch->job(batch->arg, i);
+    if(batch->count != __atomic_add_fetch(&(batch->done), 1, __ATOMIC_ACQ_REL)){
+      continue;
+    }
+    if(batch->done_cb){
+      batch->done_cb(batch->arg);
+    } else {
+      pthread_mutex_lock(&(batch->lock));
+      pthread_cond_signal(&(batch->cond));
+      pthread_mutex_unlock(&(batch->lock));
+    }
+  }
+}
+
+static void* parallel_pool_worker(void* arg){
+  for(;;){
+    pthread_mutex_lock(&parallel_pool_lock);
+    while(!parallel_pool_head && !parallel_pool_stopping){
+      pthread_cond_wait(&parallel_pool_cond, &parallel_pool_lock);
+    }
+    parallel_task_t *task = parallel_pool_head;
+    if(!task){
+      pthread_mutex_unlock(&parallel_pool_lock);
+      return NULL;
+    }
+    parallel_pool_head = task->next;
+    if(!parallel_pool_head){
+      parallel_pool_tail = NULL;
+    }
+    pthread_mutex_unlock(&parallel_pool_lock);
+    parallel_batch_work(task->batch);
+    parallel_batch_release(task->batch);
+    free(task);
+  }
+}
+
+static size_t parallel_pool_start(void){
+  pid_t pid = getpid();
+  if(pid == parallel_pool_pid){
+    return parallel_pool_size;
+  }
+  //inherited over fork: the parent's workers don't exist here, its lock may be held
+  pthread_mutex_init(&parallel_pool_lock, NULL);
+  pthread_cond_init(&parallel_pool_cond, NULL);
+  parallel_pool_head = parallel_pool_tail = NULL;
+  parallel_pool_stopping = 0;
+  parallel_pool_pid = pid;
+  for(parallel_pool_size=0; parallel_pool_size<RD_THEMIS_MAX_WORKERS; ++parallel_pool_size){
+    if(0 != pthread_create(&(parallel_pool_threads[parallel_pool_size]), NULL, parallel_pool_worker, NULL)){
+      break;
+    }
+  }
+  return parallel_pool_size;
+}
+
+static void parallel_pool_stop(void){
+  size_t i;
+  if(getpid() != parallel_pool_pid){
+    return;
+  }
+  pthread_mutex_lock(&parallel_pool_lock);
+  parallel_pool_stopping = 1;
+  pthread_cond_broadcast(&parallel_pool_cond);
+  pthread_mutex_unlock(&parallel_pool_lock);
+  for(i=0; i<parallel_pool_size; ++i){
+    pthread_join(parallel_pool_threads[i], NULL);
+  }
+  parallel_pool_size = 0;
+  parallel_pool_pid = 0;
+}
+
+static parallel_batch_t* parallel_batch_new(size_t count, parallel_job_t job, parallel_done_t done_cb, void* arg, size_t helpers){
+  parallel_batch_t *batch = calloc(1, sizeof(parallel_batch_t));
+  parallel_task_t *first=NULL, *last=NULL;
+  size_t i;
+  if(!batch){
+    return NULL;
+  }
+  batch->job = job;
+  batch->done_cb = done_cb;
+  batch->arg = arg;
+  batch->count = count;
+  batch->refs = helpers+1;
+  pthread_mutex_init(&(batch->lock), NULL);
+  pthread_cond_init(&(batch->cond), NULL);
+  for(i=0; i<helpers; ++i){
+    parallel_task_t *task = calloc(1, sizeof(parallel_task_t));
+    if(!task){
+      batch->refs -= helpers-i;
+      break;
+    }
+    task->batch = batch;
+    if(last){
+      last->next = task;
+    } else {
+      first = task;
+    }
+    last = task;
+  }
+  if(!first){
+    pthread_mutex_destroy(&(batch->lock));
+    pthread_cond_destroy(&(batch->cond));
+    free(batch);
+    return NULL;
+  }
+  pthread_mutex_lock(&parallel_pool_lock);
+  if(parallel_pool_tail){
+    parallel_pool_tail->next = first;
+  } else {
+    parallel_pool_head = first;
+  }
+  parallel_pool_tail = last;
+  pthread_cond_broadcast(&parallel_pool_cond);
+  pthread_mutex_unlock(&parallel_pool_lock);
+  return batch;
+}
+
+static size_t parallel_helpers(size_t count, size_t pool_size){
+  size_t helpers = count/RD_THEMIS_MIN_ITEMS_PER_WORKER;
+  return (helpers>pool_size)?pool_size:helpers;
+}
+
+//run the batch on the calling thread together with pool workers and wait for it
+static void parallel_run(size_t count, parallel_job_t job, void* arg){
+  size_t i, helpers = (count<2*RD_THEMIS_MIN_ITEMS_PER_WORKER)?0:parallel_helpers(count, parallel_pool_start());
+  parallel_batch_t *batch = helpers?parallel_batch_new(count, job, NULL, arg, helpers):NULL;
+  if(!batch){
+    for(i=0; i<count; ++i){
+      job(arg, i);
+    }
+    return;
+  }
+  parallel_batch_work(batch);
+  pthread_mutex_lock(&(batch->lock));
+  while(__atomic_load_n(&(batch->done), __ATOMIC_ACQUIRE) < count){
+    pthread_cond_wait(&(batch->cond), &(batch->lock));
+  }
+  pthread_mutex_unlock(&(batch->lock));
+  parallel_batch_release(batch);
+}
+
+//run the batch on pool workers only, done_cb(arg) is called from the worker finishing it
+static void parallel_submit(size_t count, parallel_job_t job, parallel_done_t done_cb, void* arg){
+  size_t helpers = parallel_helpers(count, parallel_pool_start());
+  if(0 == helpers && parallel_pool_size){
+    helpers = 1;
+  }
+  parallel_batch_t *batch = helpers?parallel_batch_new(count, job, done_cb, arg, helpers):NULL;
+  if(!batch){
+    parallel_run(count, job, arg);
+    done_cb(arg);
+    return;
+  }
+  parallel_batch_release(batch);
+}
+
+//one element of list/stream, reply bytes are copied so workers never touch the keyspace
+typedef struct range_item_type{
+  uint8_t* data;
+  size_t data_len;
+  int encrypted;
+  uint8_t* plain;
+  size_t plain_len;
+  int status;
+} range_item_t;
+
+typedef struct range_job_type{
+  RedisModuleBlockedClient* bc;
+  uint8_t* pass;
+  size_t pass_len;
+  int stream;
+  size_t entries;
+  size_t* pairs;
+  size_t count;
+  range_item_t* items;
+} range_job_t;
+
+static range_job_t* range_job_new(const uint8_t* pass, size_t pass_len, size_t count){
+  range_job_t *job = RedisModule_Calloc(1, sizeof(range_job_t));
+  job->pass = secure_copy(pass, pass_len);
+  job->pass_len = pass_len;
+  job->count = count;
+  job->items = RedisModule_Calloc(count, sizeof(range_item_t));
+  return job;
+}
+
+static void range_item_set(range_item_t* item, RedisModuleCallReply* reply, int encrypted){
+  size_t len=0;
+  const char* ptr = RedisModule_CallReplyStringPtr(reply, &len);
+  item->data = RedisModule_Alloc(len?len:1);
+  if(ptr){
+    memcpy(item->data, ptr, len);
+  }
+  item->data_len = len;
+  item->encrypted = encrypted;
+}
+
+void range_job_free(void* privdata){
+  range_job_t *job = privdata;
+  size_t i;
+  for(i=0; i<job->count; ++i){
+    RedisModule_Free(job->items[i].data);
+    secure_free(job->items[i].plain);
+  }
+  RedisModule_Free(job->items);
+  if(job->pairs){
+    RedisModule_Free(job->pairs);
+  }
+  secure_free(job->pass);
+  RedisModule_Free(job);
+}
+
+static void range_decrypt_item(void* arg, size_t idx){
+  range_job_t *job = arg;
+  range_item_t *item = &(job->items[idx]);
+  if(!item->encrypted){
+    return;
+  }
+  item->status = scell_open(job->pass, job->pass_len, item->data, item->data_len, &(item->plain), &(item->plain_len));
+}
+
+static void range_reply_item(RedisModuleCtx *ctx, range_item_t* item){
+  if(item->encrypted){
+    RedisModule_ReplyWithStringBuffer(ctx, (const char*)item->plain, item->plain_len);
+  } else {
+    RedisModule_ReplyWithStringBuffer(ctx, (const char*)item->data, item->data_len);
+  }
+}
+
+int range_reply(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+  range_job_t *job = RedisModule_GetBlockedClientPrivateData(ctx);
+  size_t i, j, k=0;
+  for(i=0; i<job->count; ++i){
+    if(0!=job->items[i].status){
+      return RedisModule_ReplyWithError(ctx, "ERR secure seal decryption failed");
+    }
+  }
+  if(!job->stream){
+    RedisModule_ReplyWithArray(ctx, job->count);
+    for(i=0; i<job->count; ++i){
+      range_reply_item(ctx, &(job->items[i]));
+    }
+    return REDISMODULE_OK;
+  }
+  RedisModule_ReplyWithArray(ctx, job->entries);
+  for(i=0; i<job->entries; ++i){
+    RedisModule_ReplyWithArray(ctx, 2);
+    range_reply_item(ctx, &(job->items[k++]));
+    RedisModule_ReplyWithArray(ctx, 2*job->pairs[i]);
+    for(j=0; j<2*job->pairs[i]; ++j){
+      range_reply_item(ctx, &(job->items[k++]));
+    }
+  }
+  return REDISMODULE_OK;
+}
+
+int range_timeout(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+  return RedisModule_ReplyWithSimpleString(ctx,"Request timedout");
+}
+
+static void range_done(void* arg){
+  range_job_t *job = arg;
+  RedisModule_UnblockClient(job->bc, job);
+}
+
+static int range_dispatch(RedisModuleCtx *ctx, range_job_t *job){
+  job->bc = RedisModule_BlockClient(ctx, range_reply, range_timeout, range_job_free, 2000);
+  parallel_submit(job->count, range_decrypt_item, range_done, job);
+  return REDISMODULE_OK;
+}
+
+typedef struct seal_batch_type{
+  const uint8_t* pass;
+  size_t pass_len;
+  RedisModuleString** in;
+  uint8_t** out;
+  size_t* out_len;
+  int* status;
+} seal_batch_t;
+
+static void seal_batch_item(void* arg, size_t idx){
+  seal_batch_t *batch = arg;
+  size_t message_len=0;
+  const uint8_t *message = (const uint8_t*)RedisModule_StringPtrLen(batch->in[idx], &message_len);
+  batch->status[idx] = scell_seal(batch->pass, batch->pass_len, message, message_len, &(batch->out[idx]), &(batch->out_len[idx]));
+}
+
+//seal count strings in parallel, on success caller owns out[i]
+static int seal_batch(const uint8_t* pass, size_t pass_len, RedisModuleString** in, size_t count, uint8_t** out, size_t* out_len){
+  seal_batch_t batch = {pass, pass_len, in, out, out_len, NULL};
+  size_t i;
+  int res=0;
+  batch.status = RedisModule_Calloc(count, sizeof(int));
+  parallel_run(count, seal_batch_item, &batch);
+  for(i=0; i<count; ++i){
+    if(0!=batch.status[i]){
+      res=-1;
+    }
+  }
+  if(0!=res){
+    for(i=0; i<count; ++i){
+      if(0==batch.status[i]){
+        free(out[i]);
+      }
+    }
+  }
+  RedisModule_Free(batch.status);
+  return res;
+}
+
+static int cmd_scell_list_push(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc < 4) {
+        RedisModule_WrongArity(ctx);
+        return REDISMODULE_OK;
+    }
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ|REDISMODULE_WRITE);
+    int type = RedisModule_KeyType(key);
+    if(REDISMODULE_KEYTYPE_EMPTY != type && REDISMODULE_KEYTYPE_LIST != type){
+      RedisModule_CloseKey(key);
+      RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+      return REDISMODULE_ERR;
+    }
+    size_t pass_len=0, count=argc-3, i;
+    const uint8_t *pass = (const uint8_t*)RedisModule_StringPtrLen(argv[2], &pass_len);
+    uint8_t **encrypted_data = RedisModule_Calloc(count, sizeof(uint8_t*));
+    size_t *encrypted_data_len = RedisModule_Calloc(count, sizeof(size_t));
+    if(0 != seal_batch(pass, pass_len, argv+3, count, encrypted_data, encrypted_data_len)){
+      RedisModule_Free(encrypted_data);
+      RedisModule_Free(encrypted_data_len);
+      RedisModule_CloseKey(key);
+      RedisModule_ReplyWithError(ctx, "ERR secure seal encryption failed");
+      return REDISMODULE_ERR;
+    }
+    //AOF and replicas get RPUSH of the secure cells, never the password or plain text
+    RedisModuleString **args = RedisModule_Calloc(count+1, sizeof(RedisModuleString*));
+    args[0] = argv[1];
+    for(i=0; i<count; ++i){
+      args[1+i] = RedisModule_CreateString(ctx, (const char*)encrypted_data[i], encrypted_data_len[i]);
+      RedisModule_ListPush(key, REDISMODULE_LIST_TAIL, args[1+i]);
+      free(encrypted_data[i]);
+    }
+    RedisModule_Replicate(ctx, "RPUSH", "v", args, count+1);
+    for(i=0; i<count; ++i){
+      RedisModule_FreeString(ctx, args[1+i]);
+    }
+    RedisModule_Free(args);
+    RedisModule_Free(encrypted_data);
+    RedisModule_Free(encrypted_data_len);
+    RedisModule_ReplyWithLongLong(ctx, RedisModule_ValueLength(key));
+    RedisModule_CloseKey(key);
+    return REDISMODULE_OK;
+}
+
+static int cmd_scell_list_range(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 5) {
+        RedisModule_WrongArity(ctx);
+        return REDISMODULE_OK;
+    }
+    long long start=0, stop=0;
+    if(REDISMODULE_OK != RedisModule_StringToLongLong(argv[3], &start) || REDISMODULE_OK != RedisModule_StringToLongLong(argv[4], &stop)){
+      RedisModule_ReplyWithError(ctx, "ERR value is not an integer or out of range");
+      return REDISMODULE_ERR;
+    }
+    RedisModuleCallReply *reply = RedisModule_Call(ctx, "LRANGE", "sll", argv[1], start, stop);
+    if(REDISMODULE_REPLY_ARRAY != RedisModule_CallReplyType(reply)){
+      RedisModule_ReplyWithCallReply(ctx, reply);
+      RedisModule_FreeCallReply(reply);
+      return REDISMODULE_OK;
+    }
+    size_t count = RedisModule_CallReplyLength(reply), i;
+    if(0 == count){
+      RedisModule_FreeCallReply(reply);
+      return RedisModule_ReplyWithArray(ctx, 0);
+    }
+    size_t pass_len=0;
+    const uint8_t *pass = (const uint8_t*)RedisModule_StringPtrLen(argv[2], &pass_len);
+    range_job_t *job = range_job_new(pass, pass_len, count);
+    for(i=0; i<count; ++i){
+      range_item_set(&(job->items[i]), RedisModule_CallReplyArrayElement(reply, i), 1);
+    }
+    RedisModule_FreeCallReply(reply);
+    return range_dispatch(ctx, job);
+}
+
+static int cmd_scell_stream_add(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc < 6 || 0 != (argc-4)%2) {
+        RedisModule_WrongArity(ctx);
+        return REDISMODULE_OK;
+    }
+    size_t pass_len=0, pairs=(argc-4)/2, i;
+    const uint8_t *pass = (const uint8_t*)RedisModule_StringPtrLen(argv[2], &pass_len);
+    RedisModuleString **values = RedisModule_Calloc(pairs, sizeof(RedisModuleString*));
+    uint8_t **encrypted_data = RedisModule_Calloc(pairs, sizeof(uint8_t*));
+    size_t *encrypted_data_len = RedisModule_Calloc(pairs, sizeof(size_t));
+    for(i=0; i<pairs; ++i){
+      values[i] = argv[5+2*i];
+    }
+    if(0 != seal_batch(pass, pass_len, values, pairs, encrypted_data, encrypted_data_len)){
+      RedisModule_Free(values);
+      RedisModule_Free(encrypted_data);
+      RedisModule_Free(encrypted_data_len);
+      RedisModule_ReplyWithError(ctx, "ERR secure seal encryption failed");
+      return REDISMODULE_ERR;
+    }
+    //XADD key id field value [field value ...] with values replaced by their secure cells
+    RedisModuleString **args = RedisModule_Calloc(argc-2, sizeof(RedisModuleString*));
+    args[0] = argv[1];
+    args[1] = argv[3];
+    for(i=0; i<pairs; ++i){
+      args[2+2*i] = argv[4+2*i];
+      args[3+2*i] = RedisModule_CreateString(ctx, (const char*)encrypted_data[i], encrypted_data_len[i]);
+      free(encrypted_data[i]);
+    }
+    //replicated by redis itself with the resolved id and the secure cells
+    RedisModuleCallReply *reply = RedisModule_Call(ctx, "XADD", "!v", args, (size_t)(argc-2));
+    RedisModule_ReplyWithCallReply(ctx, reply);
+    RedisModule_FreeCallReply(reply);
+    for(i=0; i<pairs; ++i){
+      RedisModule_FreeString(ctx, args[3+2*i]);
+    }
+    RedisModule_Free(args);
+    RedisModule_Free(values);
+    RedisModule_Free(encrypted_data);
+    RedisModule_Free(encrypted_data_len);
+    return REDISMODULE_OK;
+}
+
+static int cmd_scell_stream_range(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 5 && argc != 7) {
+        RedisModule_WrongArity(ctx);
+        return REDISMODULE_OK;
+    }
+    //XRANGE key start end [COUNT n]
+    RedisModuleString **args = RedisModule_Calloc(argc-2, sizeof(RedisModuleString*));
+    int i;
+    args[0] = argv[1];
+    for(i=3; i<argc; ++i){
+      args[i-2] = argv[i];
+    }
+    RedisModuleCallReply *reply = RedisModule_Call(ctx, "XRANGE", "v", args, (size_t)(argc-2));
+    RedisModule_Free(args);
+    if(REDISMODULE_REPLY_ARRAY != RedisModule_CallReplyType(reply)){
+      RedisModule_ReplyWithCallReply(ctx, reply);
+      RedisModule_FreeCallReply(reply);
+      return REDISMODULE_OK;
+    }
+    size_t entries = RedisModule_CallReplyLength(reply), count=0, e, j, k=0;
+    if(0 == entries){
+      RedisModule_FreeCallReply(reply);
+      return RedisModule_ReplyWithArray(ctx, 0);
+    }
+    for(e=0; e<entries; ++e){
+      RedisModuleCallReply *fields = RedisModule_CallReplyArrayElement(RedisModule_CallReplyArrayElement(reply, e), 1);
+      count += 1+RedisModule_CallReplyLength(fields);
+    }
+    size_t pass_len=0;
+    const uint8_t *pass = (const uint8_t*)RedisModule_StringPtrLen(argv[2], &pass_len);
+    range_job_t *job = range_job_new(pass, pass_len, count);
+    job->stream = 1;
+    job->entries = entries;
+    job->pairs = RedisModule_Calloc(entries, sizeof(size_t));
+    for(e=0; e<entries; ++e){
+      RedisModuleCallReply *entry = RedisModule_CallReplyArrayElement(reply, e);
+      RedisModuleCallReply *fields = RedisModule_CallReplyArrayElement(entry, 1);
+      size_t fields_count = RedisModule_CallReplyLength(fields);
+      job->pairs[e] = fields_count/2;
+      range_item_set(&(job->items[k++]), RedisModule_CallReplyArrayElement(entry, 0), 0);
+      for(j=0; j<fields_count; ++j){
+        range_item_set(&(job->items[k++]), RedisModule_CallReplyArrayElement(fields, j), j%2);
+      }
+    }
+    RedisModule_FreeCallReply(reply);
+    return range_dispatch(ctx, job);
+}
+
+/*
+ * Server-side read-modify-write on secure cell values. The stored value is
+ * copied out, decrypted, modified and encrypted again on a worker thread.
+ * Before write-back the reply callback compares the key with the copy; if it
+ * was changed meanwhile, the operation is redone on the main thread against
+ * the current value, so the client never has to retry.
+ * New value keeps the storage mode (seal or context imprint) of the old one.
+ */
+#define RMW_CAS 0
+#define RMW_INCR 1
+
+typedef struct rmw_job_type{
+  int op;
+  uint8_t* key_name;
+  size_t key_name_len;
+  uint8_t* pass;
+  size_t pass_len;
+  uint8_t* expected;
+  size_t expected_len;
+  uint8_t* replacement;
+  size_t replacement_len;
+  long long increment;
+  long long result;
+  int exists;
+  uint8_t* snapshot;
+  size_t snapshot_len;
+  uint8_t* out;
+  size_t out_len;
+  int status;
+  RedisModuleBlockedClient* bc;
+} rmw_job_t;
+
+void rmw_job_free(void* privdata){
+  rmw_job_t *job = privdata;
+  RedisModule_Free(job->key_name);
+  if(job->snapshot){
+    RedisModule_Free(job->snapshot);
+  }
+  free(job->out);
+  secure_free(job->pass);
+  secure_free(job->expected);
+  secure_free(job->replacement);
+  RedisModule_Free(job);
+}
+
+//strict decimal, same as redis INCR accepts
+static int rmw_parse_ll(const uint8_t* data, size_t data_len, long long* value){
+  char buf[32];
+  char* end=NULL;
+  size_t i;
+  if(0 == data_len || data_len>=sizeof(buf)){
+    return -1;
+  }
+  for(i=0; i<data_len; ++i){
+    if((data[i]<'0' || data[i]>'9') && !(0 == i && '-' == data[i] && data_len>1)){
+      return -1;
+    }
+  }
+  memcpy(buf, data, data_len);
+  buf[data_len]=0;
+  errno=0;
+  *value = strtoll(buf, &end, 10);
+  secure_zero(buf, sizeof(buf));
+  if(0 != errno){
+    return -1;
+  }
+  return 0;
+}
+
+static int rmw_seal(rmw_job_t* job, int imprint, const uint8_t* message, size_t message_len){
+  free(job->out);
+  job->out=NULL;
+  if(!imprint){
+    return scell_seal(job->pass, job->pass_len, message, message_len, &(job->out), &(job->out_len));
+  }
+  size_t encrypted_data_len=0;
+  if(THEMIS_BUFFER_TOO_SMALL!=themis_secure_cell_encrypt_context_imprint(job->pass, job->pass_len, message, message_len, job->key_name, job->key_name_len, NULL, &encrypted_data_len)){
+    return -1;
+  }
+  job->out = malloc(1+encrypted_data_len);
+  if(!(job->out)){
+    return -1;
+  }
+  job->out[0] = SCELL_IMPRINT_MARKER;
+  if(THEMIS_SUCCESS!=themis_secure_cell_encrypt_context_imprint(job->pass, job->pass_len, message, message_len, job->key_name, job->key_name_len, job->out+1, &encrypted_data_len)){
+    free(job->out);
+    job->out=NULL;
+    return -1;
+  }
+  job->out_len = 1+encrypted_data_len;
+  return 0;
+}
+
+//0 - job->out holds new value, 1 - compare failed, -1 - decryption failed, -4 - not an integer, -5 - overflow, -6 - encryption failed
+static int rmw_apply(rmw_job_t* job, const uint8_t* value, size_t value_len, int exists){
+  uint8_t* plain=NULL;
+  size_t plain_len=0;
+  int imprint = (exists && value_len>1 && SCELL_IMPRINT_MARKER == value[0]), res;
+  if(exists){
+    if(imprint){
+      res = scell_imprint_open(job->key_name, job->key_name_len, job->pass, job->pass_len, value+1, value_len-1, &plain, &plain_len);
+    } else {
+      res = scell_open(job->pass, job->pass_len, value, value_len, &plain, &plain_len);
+    }
+    if(0 != res){
+      return -1;
+    }
+  }
+  if(RMW_CAS == job->op){
+    if(!exists || plain_len != job->expected_len || 0 != memcmp(plain, job->expected, plain_len)){
+      secure_free(plain);
+      return 1;
+    }
+    secure_free(plain);
+    return (0 == rmw_seal(job, imprint, job->replacement, job->replacement_len))?0:-6;
+  }
+  long long current=0;
+  if(exists && 0 != rmw_parse_ll(plain, plain_len, &current)){
+    secure_free(plain);
+    return -4;
+  }
+  secure_free(plain);
+  if((job->increment<0 && current<LLONG_MIN-job->increment) || (job->increment>0 && current>LLONG_MAX-job->increment)){
+    return -5;
+  }
+  job->result = current+job->increment;
+  char buf[32];
+  int buf_len = snprintf(buf, sizeof(buf), "%lld", job->result);
+  res = rmw_seal(job, imprint, (const uint8_t*)buf, buf_len);
+  secure_zero(buf, sizeof(buf));
+  return (0 == res)?0:-6;
+}
+
+//runs in main thread, writes job->out back unless the key changed since the snapshot
+static int rmw_write_back(RedisModuleCtx *ctx, rmw_job_t* job){
+  RedisModuleString *key_name = RedisModule_CreateString(ctx, (const char*)job->key_name, job->key_name_len);
+  RedisModuleKey *key = RedisModule_OpenKey(ctx, key_name, REDISMODULE_READ|REDISMODULE_WRITE);
+  int type = RedisModule_KeyType(key), res;
+  if(REDISMODULE_KEYTYPE_EMPTY != type && REDISMODULE_KEYTYPE_STRING != type){
+    res = -3;
+  } else {
+    size_t current_len=0;
+    int exists = (REDISMODULE_KEYTYPE_STRING == type);
+    const uint8_t* current = exists?(const uint8_t*)RedisModule_StringDMA(key, &current_len, REDISMODULE_READ):NULL;
+    res = job->status;
+    if(exists != job->exists || current_len != job->snapshot_len || (exists && 0 != memcmp(current, job->snapshot, current_len))){
+      res = rmw_apply(job, current, current_len, exists);
+    }
+    if(0 == res){
+      size_t value_len=0;
+      if(REDISMODULE_OK != RedisModule_StringTruncate(key, job->out_len)){
+        res = -6;
+      } else {
+        memcpy(RedisModule_StringDMA(key, &value_len, REDISMODULE_WRITE), job->out, job->out_len);
+        //AOF and replicas get the resulting secure cell, never the password; SET drops the ttl the write kept
+        mstime_t ttl = RedisModule_GetExpire(key);
+        RedisModule_Replicate(ctx, "SET", "sb", key_name, (const char*)job->out, job->out_len);
+        if(REDISMODULE_NO_EXPIRE != ttl){
+          RedisModule_Replicate(ctx, "PEXPIRE", "sl", key_name, (long long)ttl);
+        }
+      }
+    }
+  }
+  RedisModule_CloseKey(key);
+  RedisModule_FreeString(ctx, key_name);
+  return res;
+}
+
+int rmw_reply(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+  rmw_job_t *job = RedisModule_GetBlockedClientPrivateData(ctx);
+  int res = job->status;
+  if(0 == res || 1 == res){
+    res = rmw_write_back(ctx, job);
+  }
+  switch(res){
+  case 0:
+    return RedisModule_ReplyWithLongLong(ctx, (RMW_CAS == job->op)?1:job->result);
+  case 1:
+    return RedisModule_ReplyWithLongLong(ctx, 0);
+  case -3:
+    return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+  case -4:
+    return RedisModule_ReplyWithError(ctx, "ERR value is not an integer or out of range");
+  case -5:
+    return RedisModule_ReplyWithError(ctx, "ERR increment or decrement would overflow");
+  case -6:
+    return RedisModule_ReplyWithError(ctx, "ERR secure seal encryption failed");
+  }
+  return RedisModule_ReplyWithError(ctx, "ERR secure seal decryption failed");
+}
+
+int rmw_timeout(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+  return RedisModule_ReplyWithSimpleString(ctx,"Request timedout");
+}
+
+static void rmw_item(void* arg, size_t idx){
+  rmw_job_t *job = arg;
+  job->status = rmw_apply(job, job->snapshot, job->snapshot_len, job->exists);
+}
+
+static void rmw_done(void* arg){
+  rmw_job_t *job = arg;
+  RedisModule_UnblockClient(job->bc, job);
+}
+
+//snapshot the key on the main thread and hand the job to the worker pool
+static int rmw_dispatch(RedisModuleCtx *ctx, RedisModuleString **argv, rmw_job_t *job){
+  RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+  int type = RedisModule_KeyType(key);
+  if(REDISMODULE_KEYTYPE_EMPTY != type && REDISMODULE_KEYTYPE_STRING != type){
+    RedisModule_CloseKey(key);
+    rmw_job_free(job);
+    return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+  }
+  size_t len=0;
+  const char *ptr = RedisModule_StringPtrLen(argv[1], &len);
+  job->key_name = RedisModule_Alloc(len?len:1);
+  memcpy(job->key_name, ptr, len);
+  job->key_name_len = len;
+  ptr = RedisModule_StringPtrLen(argv[2], &len);
+  job->pass = secure_copy((const uint8_t*)ptr, len);
+  job->pass_len = len;
+  job->exists = (REDISMODULE_KEYTYPE_STRING == type);
+  if(job->exists){
+    ptr = RedisModule_StringDMA(key, &len, REDISMODULE_READ);
+    job->snapshot = RedisModule_Alloc(len?len:1);
+    memcpy(job->snapshot, ptr, len);
+    job->snapshot_len = len;
+  }
+  RedisModule_CloseKey(key);
+
+  job->bc = RedisModule_BlockClient(ctx, rmw_reply, rmw_timeout, rmw_job_free, 2000);
+  parallel_submit(1, rmw_item, rmw_done, job);
+  return REDISMODULE_OK;
+}
+
+static int cmd_scell_compare_and_swap(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 5) {
+        RedisModule_WrongArity(ctx);
+        return REDISMODULE_OK;
+    }
+    size_t len=0;
+    const char *ptr;
+    rmw_job_t *job = RedisModule_Calloc(1, sizeof(rmw_job_t));
+    job->op = RMW_CAS;
+    ptr = RedisModule_StringPtrLen(argv[3], &len);
+    job->expected = secure_copy((const uint8_t*)ptr, len);
+    job->expected_len = len;
+    ptr = RedisModule_StringPtrLen(argv[4], &len);
+    job->replacement = secure_copy((const uint8_t*)ptr, len);
+    job->replacement_len = len;
+    return rmw_dispatch(ctx, argv, job);
+}
+
+static int cmd_scell_increment(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 3 && argc != 4) {
+        RedisModule_WrongArity(ctx);
+        return REDISMODULE_OK;
+    }
+    long long increment=1;
+    if(4 == argc && REDISMODULE_OK != RedisModule_StringToLongLong(argv[3], &increment)){
+      RedisModule_ReplyWithError(ctx, "ERR value is not an integer or out of range");
+      return REDISMODULE_ERR;
+    }
+    rmw_job_t *job = RedisModule_Calloc(1, sizeof(rmw_job_t));
+    job->op = RMW_INCR;
+    job->increment = increment;
+    return rmw_dispatch(ctx, argv, job);
+}
+
+/*
+ * Persistence-time encryption: rdthm-pst values are kept in memory as plain
+ * text and sealed with the configured persistence key only when written to
+ * RDB or AOF. Values are sealed in chunks, so large values are processed by
+ * several workers.
+ * Serialized value: uint32 chunk count | uint64 total length | random nonce[16],
+ * then per chunk uint32 length and secure cell. Each chunk is sealed with
+ * nonce, index, count and total length as context, so chunks can't be
+ * dropped, reordered or moved to another value.
+ */
+#define PERSIST_TYPE_ENCVER 0
+#define PERSIST_CHUNK_SIZE (64*1024)
+#define PERSIST_NONCE_LEN 16
+//same as redis proto-max-bulk-len default, nothing larger can be set by a client
+#define PERSIST_MAX_LEN (512ULL*1024*1024)
+
+static RedisModuleType *persist_type=NULL;
+static uint8_t* persist_key=NULL;
+static size_t persist_key_len=0;
+static int persist_replicate=0;
+//redis process the module was loaded into, save callbacks in other processes run in a fork child
+static pid_t persist_main_pid=0;
+
+typedef struct persist_value_type{
+  uint8_t* data;
+  size_t data_len;
+} persist_value_t;
+
+typedef struct persist_chunk_type{
+  const uint8_t* in;
+  size_t in_len;
+  uint8_t* out;
+  size_t out_len;
+  int status;
+} persist_chunk_t;
+
+typedef struct persist_batch_type{
+  persist_chunk_t* chunks;
+  const uint8_t* nonce;
+  uint32_t count;
+  uint64_t total_len;
+} persist_batch_t;
+
+typedef struct persist_context_type{
+  uint8_t nonce[PERSIST_NONCE_LEN];
+  uint32_t index;
+  uint32_t count;
+  uint64_t total_len;
+} persist_context_t;
+
+static persist_value_t* persist_value_new(const uint8_t* data, size_t data_len){
+  persist_value_t *value = RedisModule_Alloc(sizeof(persist_value_t));
+  value->data = RedisModule_Alloc(data_len?data_len:1);
+  memcpy(value->data, data, data_len);
+  value->data_len = data_len;
+  return value;
+}
+
+void persist_value_free(void* arg){
+  persist_value_t *value = arg;
+  RedisModule_Free(value->data);
+  RedisModule_Free(value);
+}
+
+static void persist_context(const persist_batch_t* batch, size_t idx, persist_context_t* context){
+  memset(context, 0, sizeof(persist_context_t));
+  memcpy(context->nonce, batch->nonce, PERSIST_NONCE_LEN);
+  context->index = idx;
+  context->count = batch->count;
+  context->total_len = batch->total_len;
+}
+
+static size_t persist_chunk_len(uint64_t total_len, uint32_t count, size_t idx){
+  return (idx+1 == count)?(total_len-(uint64_t)idx*PERSIST_CHUNK_SIZE):PERSIST_CHUNK_SIZE;
+}
+
+static void persist_seal_chunk(void* arg, size_t idx){
+  persist_batch_t *batch = arg;
+  persist_chunk_t *chunk = batch->chunks+idx;
+  persist_context_t context;
+  persist_context(batch, idx, &context);
+  chunk->status = -1;
+  if(THEMIS_BUFFER_TOO_SMALL!=themis_secure_cell_encrypt_seal(persist_key, persist_key_len, (const uint8_t*)&context, sizeof(context), chunk->in, chunk->in_len, NULL, &(chunk->out_len))){
+    return;
+  }
+  chunk->out = RedisModule_Alloc(chunk->out_len);
+  if(THEMIS_SUCCESS!=themis_secure_cell_encrypt_seal(persist_key, persist_key_len, (const uint8_t*)&context, sizeof(context), chunk->in, chunk->in_len, chunk->out, &(chunk->out_len))){
+    return;
+  }
+  chunk->status = 0;
+}
+
+//opened plaintext goes to the secure arena until it is copied into the value
+static void persist_open_chunk(void* arg, size_t idx){
+  persist_batch_t *batch = arg;
+  persist_chunk_t *chunk = batch->chunks+idx;
+  persist_context_t context;
+  persist_context(batch, idx, &context);
+  chunk->status = -1;
+  if(THEMIS_BUFFER_TOO_SMALL!=themis_secure_cell_decrypt_seal(persist_key, persist_key_len, (const uint8_t*)&context, sizeof(context), chunk->in, chunk->in_len, NULL, &(chunk->out_len))){
+    return;
+  }
+  chunk->out = secure_alloc(chunk->out_len);
+  if(!(chunk->out)){
+    return;
+  }
+  if(THEMIS_SUCCESS!=themis_secure_cell_decrypt_seal(persist_key, persist_key_len, (const uint8_t*)&context, sizeof(context), chunk->in, chunk->in_len, chunk->out, &(chunk->out_len))){
+    return;
+  }
+  if(chunk->out_len != persist_chunk_len(batch->total_len, batch->count, idx)){
+    return;
+  }
+  chunk->status = 0;
+}
+
+static void persist_chunks_free(persist_chunk_t* chunks, size_t count, int opened){
+  size_t i;
+  for(i=0; i<count; ++i){
+    if(!chunks[i].out){
+      continue;
+    }
+    if(opened){
+      secure_free(chunks[i].out);
+    } else {
+      RedisModule_Free(chunks[i].out);
+    }
+  }
+  RedisModule_Free(chunks);
+}
+
+//seal value into newly allocated serialized buffer, caller frees it with RedisModule_Free
+static int persist_seal(const persist_value_t* value, uint8_t** sealed, size_t* sealed_len){
+  uint8_t nonce[PERSIST_NONCE_LEN];
+  persist_batch_t batch = {NULL, nonce, (value->data_len+PERSIST_CHUNK_SIZE-1)/PERSIST_CHUNK_SIZE, value->data_len};
+  uint32_t i, chunk_len;
+  if(1 != RAND_bytes(nonce, sizeof(nonce))){
+    return -1;
+  }
+  batch.chunks = RedisModule_Calloc(batch.count?batch.count:1, sizeof(persist_chunk_t));
+  for(i=0; i<batch.count; ++i){
+    batch.chunks[i].in = value->data+(size_t)i*PERSIST_CHUNK_SIZE;
+    batch.chunks[i].in_len = persist_chunk_len(batch.total_len, batch.count, i);
+  }
+  parallel_run(batch.count, persist_seal_chunk, &batch);
+  *sealed_len = sizeof(batch.count)+sizeof(batch.total_len)+sizeof(nonce);
+  for(i=0; i<batch.count; ++i){
+    if(0 != batch.chunks[i].status){
+      persist_chunks_free(batch.chunks, batch.count, 0);
+      return -1;
+    }
+    *sealed_len += sizeof(chunk_len)+batch.chunks[i].out_len;
+  }
+  uint8_t *out = RedisModule_Alloc(*sealed_len);
+  *sealed = out;
+  memcpy(out, &(batch.count), sizeof(batch.count));
+  out += sizeof(batch.count);
+  memcpy(out, &(batch.total_len), sizeof(batch.total_len));
+  out += sizeof(batch.total_len);
+  memcpy(out, nonce, sizeof(nonce));
+  out += sizeof(nonce);
+  for(i=0; i<batch.count; ++i){
+    chunk_len = batch.chunks[i].out_len;
+    memcpy(out, &chunk_len, sizeof(chunk_len));
+    memcpy(out+sizeof(chunk_len), batch.chunks[i].out, chunk_len);
+    out += sizeof(chunk_len)+chunk_len;
+  }
+  persist_chunks_free(batch.chunks, batch.count, 0);
+  return 0;
+}
+
+static persist_value_t* persist_open(const uint8_t* sealed, size_t sealed_len){
+  persist_batch_t batch = {NULL, NULL, 0, 0};
+  uint32_t i, chunk_len;
+  size_t offset = sizeof(batch.count)+sizeof(batch.total_len)+PERSIST_NONCE_LEN;
+  if(NULL == persist_key || sealed_len<offset){
+    return NULL;
+  }
+  memcpy(&(batch.count), sealed, sizeof(batch.count));
+  memcpy(&(batch.total_len), sealed+sizeof(batch.count), sizeof(batch.total_len));
+  batch.nonce = sealed+sizeof(batch.count)+sizeof(batch.total_len);
+  if(batch.total_len>PERSIST_MAX_LEN || batch.total_len>(uint64_t)batch.count*PERSIST_CHUNK_SIZE || (0 == batch.count) != (0 == batch.total_len)){
+    return NULL;
+  }
+  if(batch.count != (batch.total_len+PERSIST_CHUNK_SIZE-1)/PERSIST_CHUNK_SIZE || batch.count>(sealed_len-offset)/sizeof(chunk_len)){
+    return NULL;
+  }
+  batch.chunks = RedisModule_Calloc(batch.count?batch.count:1, sizeof(persist_chunk_t));
+  for(i=0; i<batch.count; ++i){
+    if(sealed_len-offset<sizeof(chunk_len)){
+      persist_chunks_free(batch.chunks, batch.count, 1);
+      return NULL;
+    }
+    memcpy(&chunk_len, sealed+offset, sizeof(chunk_len));
+    offset += sizeof(chunk_len);
+    if(sealed_len-offset<chunk_len){
+      persist_chunks_free(batch.chunks, batch.count, 1);
+      return NULL;
+    }
+    batch.chunks[i].in = sealed+offset;
+    batch.chunks[i].in_len = chunk_len;
+    offset += chunk_len;
+  }
+  if(offset != sealed_len){
+    persist_chunks_free(batch.chunks, batch.count, 1);
+    return NULL;
+  }
+  parallel_run(batch.count, persist_open_chunk, &batch);
+  for(i=0; i<batch.count; ++i){
+    if(0 != batch.chunks[i].status){
+      persist_chunks_free(batch.chunks, batch.count, 1);
+      return NULL;
+    }
+  }
+  persist_value_t *value = RedisModule_Alloc(sizeof(persist_value_t));
+  value->data = RedisModule_Alloc(batch.total_len?batch.total_len:1);
+  value->data_len = 0;
+  for(i=0; i<batch.count; ++i){
+    memcpy(value->data+value->data_len, batch.chunks[i].out, batch.chunks[i].out_len);
+    value->data_len += batch.chunks[i].out_len;
+  }
+  persist_chunks_free(batch.chunks, batch.count, 1);
+  return value;
+}
+
+void* persist_rdb_load(RedisModuleIO *rdb, int encver){
+  if(PERSIST_TYPE_ENCVER != encver){
+    RedisModule_LogIOError(rdb, "warning", "rd_themis: unknown persisted value encoding %d", encver);
+    return NULL;
+  }
+  size_t sealed_len=0;
+  char *sealed = RedisModule_LoadStringBuffer(rdb, &sealed_len);
+  if(0 == sealed_len){
+    RedisModule_Free(sealed);
+    RedisModule_LogIOError(rdb, "warning", "rd_themis: persisted value was not sealed when this file was saved");
+    return NULL;
+  }
+  persist_value_t *value = persist_open((const uint8_t*)sealed, sealed_len);
+  RedisModule_Free(sealed);
+  if(!value){
+    RedisModule_LogIOError(rdb, "warning", "rd_themis: persisted value can't be opened, check persistence_key");
+  }
+  return value;
+}
+
+/*
+ * A value that can't be sealed must not end up in a file that silently loses
+ * it. A fork child (BGSAVE, BGREWRITEAOF) is aborted, so the save fails and
+ * the server keeps running. In the main process (SAVE, SHUTDOWN, foreground
+ * rewrite) aborting would lose the whole dataset, so an empty sealed value is
+ * written instead; loading it fails with an explicit error.
+ */
+static void persist_seal_failed(RedisModuleIO *io){
+  if(getpid() != persist_main_pid){
+    RedisModule_LogIOError(io, "warning", "rd_themis: persisted value sealing failed, aborting save");
+    abort();
+  }
+  RedisModule_LogIOError(io, "warning", "rd_themis: persisted value sealing failed, saved file won't load");
+}
+
+void persist_rdb_save(RedisModuleIO *rdb, void *arg){
+  uint8_t *sealed=NULL;
+  size_t sealed_len=0;
+  if(0 != persist_seal(arg, &sealed, &sealed_len)){
+    persist_seal_failed(rdb);
+    RedisModule_SaveStringBuffer(rdb, "", 0);
+    return;
+  }
+  RedisModule_SaveStringBuffer(rdb, (const char*)sealed, sealed_len);
+  RedisModule_Free(sealed);
+}
+
+void persist_aof_rewrite(RedisModuleIO *aof, RedisModuleString *key, void *arg){
+  uint8_t *sealed=NULL;
+  size_t sealed_len=0;
+  if(0 != persist_seal(arg, &sealed, &sealed_len)){
+    persist_seal_failed(aof);
+    RedisModule_EmitAOF(aof, "rd_themis.prestore", "sb", key, "", (size_t)0);
+    return;
+  }
+  RedisModule_EmitAOF(aof, "rd_themis.prestore", "sb", key, (const char*)sealed, sealed_len);
+  RedisModule_Free(sealed);
+}
+
+static int persist_set(RedisModuleCtx *ctx, RedisModuleString *key_name, persist_value_t *value){
+  RedisModuleKey *key = RedisModule_OpenKey(ctx, key_name, REDISMODULE_READ|REDISMODULE_WRITE);
+  int type = RedisModule_KeyType(key);
+  if(REDISMODULE_KEYTYPE_EMPTY != type && persist_type != RedisModule_ModuleTypeGetType(key)){
+    RedisModule_CloseKey(key);
+    persist_value_free(value);
+    return -3;
+  }
+  RedisModule_ModuleTypeSetValue(key, persist_type, value);
+  RedisModule_CloseKey(key);
+  return 0;
+}
+
+/*
+ * Not propagated by default, so a write costs no crypto. With
+ * persistence_replicate the value is sealed once on every write and AOF and
+ * replicas get rd_themis.prestore with the sealed value, never the plain text.
+ */
+static int cmd_persist_set(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 3) {
+        RedisModule_WrongArity(ctx);
+        return REDISMODULE_OK;
+    }
+    if(NULL == persist_key){
+      RedisModule_ReplyWithError(ctx, "ERR persistence_key is not configured");
+      return REDISMODULE_ERR;
+    }
+    size_t message_len=0, sealed_len=0;
+    const uint8_t *message = (const uint8_t*)RedisModule_StringPtrLen(argv[2], &message_len);
+    if(message_len>PERSIST_MAX_LEN){
+      RedisModule_ReplyWithError(ctx, "ERR value is too large");
+      return REDISMODULE_ERR;
+    }
+    persist_value_t *value = persist_value_new(message, message_len);
+    if(!persist_replicate){
+      if(0 != persist_set(ctx, argv[1], value)){
+        RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+        return REDISMODULE_ERR;
+      }
+      RedisModule_ReplyWithSimpleString(ctx, "OK");
+      return REDISMODULE_OK;
+    }
+    uint8_t *sealed=NULL;
+    if(0 != persist_seal(value, &sealed, &sealed_len)){
+      persist_value_free(value);
+      RedisModule_ReplyWithError(ctx, "ERR persisted value sealing failed");
+      return REDISMODULE_ERR;
+    }
+    if(0 != persist_set(ctx, argv[1], value)){
+      RedisModule_Free(sealed);
+      RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+      return REDISMODULE_ERR;
+    }
+    RedisModule_Replicate(ctx, "rd_themis.prestore", "sb", argv[1], (const char*)sealed, sealed_len);
+    RedisModule_Free(sealed);
+    RedisModule_ReplyWithSimpleString(ctx, "OK");
+    return REDISMODULE_OK;
+}
+
+static int cmd_persist_get(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 2) {
+        RedisModule_WrongArity(ctx);
+        return REDISMODULE_OK;
+    }
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+    if(REDISMODULE_KEYTYPE_EMPTY == RedisModule_KeyType(key)){
+      RedisModule_CloseKey(key);
+      RedisModule_ReplyWithLongLong(ctx, 0);
+      return REDISMODULE_OK;
+    }
+    if(NULL == persist_type || persist_type != RedisModule_ModuleTypeGetType(key)){
+      RedisModule_CloseKey(key);
+      RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+      return REDISMODULE_ERR;
+    }
+    persist_value_t *value = RedisModule_ModuleTypeGetValue(key);
+    RedisModule_ReplyWithStringBuffer(ctx, (const char*)value->data, value->data_len);
+    RedisModule_CloseKey(key);
+    return REDISMODULE_OK;
+}
+
+//loads value sealed by pset propagation or aof rewrite
+static int cmd_persist_restore(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 3) {
+        RedisModule_WrongArity(ctx);
+        return REDISMODULE_OK;
+    }
+    size_t sealed_len=0;
+    const uint8_t *sealed = (const uint8_t*)RedisModule_StringPtrLen(argv[2], &sealed_len);
+    if(0 == sealed_len){
+      RedisModule_ReplyWithError(ctx, "ERR persisted value was not sealed when this file was saved");
+      return REDISMODULE_ERR;
+    }
+    persist_value_t *value = persist_open(sealed, sealed_len);
+    if(!value){
+      RedisModule_ReplyWithError(ctx, "ERR persisted value can't be opened");
+      return REDISMODULE_ERR;
+    }
+    if(0 != persist_set(ctx, argv[1], value)){
+      RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+      return REDISMODULE_ERR;
+    }
+    RedisModule_ReplicateVerbatim(ctx);
+    RedisModule_ReplyWithSimpleString(ctx, "OK");
+    return REDISMODULE_OK;
+}
+
+//module arguments: [persistence_key <key>] [persistence_replicate yes|no]
+static int parse_module_args(RedisModuleCtx *ctx, RedisModuleString **argv, int argc){
+  int i;
+  for(i=0; i<argc; i+=2){
+    size_t name_len=0, value_len=0;
+    const char *name = RedisModule_StringPtrLen(argv[i], &name_len);
+    if(i+1>=argc){
+      RedisModule_Log(ctx, "warning", "rd_themis: missing value for module argument %s", name);
+      return -1;
+    }
+    const char *value = RedisModule_StringPtrLen(argv[i+1], &value_len);
+    if(0 == strcasecmp(name, "persistence_key") && value_len){
+      persist_key = secure_alloc(value_len);
+      if(!persist_key){
+        return -1;
+      }
+      memcpy(persist_key, value, value_len);
+      persist_key_len = value_len;
+    } else if(0 == strcasecmp(name, "persistence_replicate") && (0 == strcasecmp(value, "yes") || 0 == strcasecmp(value, "no"))){
+      persist_replicate = (0 == strcasecmp(value, "yes"));
+    } else {
+      RedisModule_Log(ctx, "warning", "rd_themis: unknown module argument %s", name);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int cmd_stats(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 1) {
+        RedisModule_WrongArity(ctx);
+        return REDISMODULE_OK;
+    }
+    RedisModule_ReplyWithArray(ctx, 12);
+    RedisModule_ReplyWithSimpleString(ctx, "arena_mapped_bytes");
+    RedisModule_ReplyWithLongLong(ctx, STAT_GET(secure_arena_mapped_bytes));
+    RedisModule_ReplyWithSimpleString(ctx, "arena_locked_bytes");
+    RedisModule_ReplyWithLongLong(ctx, STAT_GET(secure_arena_locked_bytes));
+    RedisModule_ReplyWithSimpleString(ctx, "arena_used_bytes");
+    RedisModule_ReplyWithLongLong(ctx, STAT_GET(secure_arena_used_bytes));
+    RedisModule_ReplyWithSimpleString(ctx, "arena_used_blocks");
+    RedisModule_ReplyWithLongLong(ctx, STAT_GET(secure_arena_used_blocks));
+    RedisModule_ReplyWithSimpleString(ctx, "imprint_values_written");
+    RedisModule_ReplyWithLongLong(ctx, STAT_GET(scell_imprint_values));
+    RedisModule_ReplyWithSimpleString(ctx, "imprint_bytes_saved_written");
+    RedisModule_ReplyWithLongLong(ctx, STAT_GET(scell_imprint_bytes_saved_written));
+    return REDISMODULE_OK;
+}
+
+//called by redis versions that support it, workers must be gone before the module is unmapped
+int RedisModule_OnUnload(RedisModuleCtx *ctx) {
+    parallel_pool_stop();
+    return REDISMODULE_OK;
+}
+
+int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (RedisModule_Init(ctx, "rd_themis", 1, REDISMODULE_APIVER_1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+    if (0 != secure_arena_init())
+        return REDISMODULE_ERR;
+    if (0 != smessage_key_sizes_init())
+        return REDISMODULE_ERR;
+    if (0 != parse_module_args(ctx, argv, argc))
+        return REDISMODULE_ERR;
+    persist_main_pid = getpid();
+    //redis refuses to unload modules exporting data types, so the type exists only when asked for
+    if (NULL != persist_key) {
+        persist_type = RedisModule_CreateDataType(ctx, "rdthm-pst", PERSIST_TYPE_ENCVER, persist_rdb_load, persist_rdb_save, persist_aof_rewrite, NULL, persist_value_free);
+        if (NULL == persist_type)
+            return REDISMODULE_ERR;
+    }
+    if (RedisModule_CreateCommand(ctx, "rd_themis.cset", cmd_scell_seal_encrypt, "no-monitor fast", 1, 1, 1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+    if (RedisModule_CreateCommand(ctx, "rd_themis.cget", cmd_scell_seal_decrypt, "no-monitor fast", 1, 1, 1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+    if (RedisModule_CreateCommand(ctx, "rd_themis.csetbl", cmd_scell_seal_encrypt_block, "no-monitor fast", 1, 1, 1) == REDISMODULE_ERR)
+      return REDISMODULE_ERR;
+    if (RedisModule_CreateCommand(ctx, "rd_themis.cgetbl", cmd_scell_seal_decrypt_block, "no-monitor fast", 1, 1, 1) == REDISMODULE_ERR)
+      return REDISMODULE_ERR;
+    if (RedisModule_CreateCommand(ctx, "rd_themis.msset", cmd_smessage_encrypt, "no-monitor fast", 1, 1, 1) == REDISMODULE_ERR)
+      return REDISMODULE_ERR;
+    if (RedisModule_CreateCommand(ctx, "rd_themis.msget", cmd_smessage_decrypt, "no-monitor fast", 1, 1, 1) == REDISMODULE_ERR)
+      return REDISMODULE_ERR;
+    if (RedisModule_CreateCommand(ctx, "rd_themis.mssetbl", cmd_smessage_encrypt_block, "no-monitor fast", 1, 1, 1) == REDISMODULE_ERR)
+      return REDISMODULE_ERR;
+    if (RedisModule_CreateCommand(ctx, "rd_themis.msgetbl", cmd_smessage_decrypt_block, "no-monitor fast", 1, 1, 1) == REDISMODULE_ERR)
+      return REDISMODULE_ERR;
+    if (RedisModule_CreateCommand(ctx, "rd_themis.clpush", cmd_scell_list_push, "write deny-oom no-monitor", 1, 1, 1) == REDISMODULE_ERR)
+      return REDISMODULE_ERR;
+    if (RedisModule_CreateCommand(ctx, "rd_themis.clrange", cmd_scell_list_range, "readonly no-monitor", 1, 1, 1) == REDISMODULE_ERR)
+      return REDISMODULE_ERR;
+    if (RedisModule_CreateCommand(ctx, "rd_themis.cxadd", cmd_scell_stream_add, "write deny-oom no-monitor", 1, 1, 1) == REDISMODULE_ERR)
+      return REDISMODULE_ERR;
+    if (RedisModule_CreateCommand(ctx, "rd_themis.cxrange", cmd_scell_stream_range, "readonly no-monitor", 1, 1, 1) == REDISMODULE_ERR)
+      return REDISMODULE_ERR;
+    if (RedisModule_CreateCommand(ctx, "rd_themis.ccas", cmd_scell_compare_and_swap, "write deny-oom no-monitor", 1, 1, 1) == REDISMODULE_ERR)
+      return REDISMODULE_ERR;
+    if (RedisModule_CreateCommand(ctx, "rd_themis.cincr", cmd_scell_increment, "write deny-oom no-monitor", 1, 1, 1) == REDISMODULE_ERR)
+      return REDISMODULE_ERR;
+    if (RedisModule_CreateCommand(ctx, "rd_themis.pset", cmd_persist_set, "write deny-oom fast", 1, 1, 1) == REDISMODULE_ERR)
+      return REDISMODULE_ERR;
+    if (RedisModule_CreateCommand(ctx, "rd_themis.pget", cmd_persist_get, "readonly fast", 1, 1, 1) == REDISMODULE_ERR)
+      return REDISMODULE_ERR;
+    if (RedisModule_CreateCommand(ctx, "rd_themis.prestore", cmd_persist_restore, "write deny-oom", 1, 1, 1) == REDISMODULE_ERR)
+      return REDISMODULE_ERR;
+    if (RedisModule_CreateCommand(ctx, "rd_themis.stats", cmd_stats, "readonly fast", 0, 0, 0) == REDISMODULE_ERR)
       return REDISMODULE_ERR;
     return REDISMODULE_OK;
 }
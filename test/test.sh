@@ -38,6 +38,43 @@ test_Rd_Themis_CGet() {
     assertEquals "test_data" "$res"
 }
 
+test_Rd_Themis_CSetImprint() {
+    res=`redis-cli rd_themis.cset test_imprint_key test_password test_data imprint`
+    assertEquals "OK" "$res"
+}
+
+test_Rd_Themis_CGetImprint() {
+    res=`redis-cli rd_themis.cget test_imprint_key test_password`
+    assertEquals "test_data" "$res"
+}
+
+test_Rd_Themis_CCas() {
+    res=`redis-cli rd_themis.ccas test_key test_password test_data test_data_2`
+    assertEquals "1" "$res"
+    res=`redis-cli rd_themis.cget test_key test_password`
+    assertEquals "test_data_2" "$res"
+}
+
+test_Rd_Themis_CCasB() {
+    res=`redis-cli rd_themis.ccas test_key test_password test_data test_data_3`
+    assertEquals "0" "$res"
+}
+
+test_Rd_Themis_CIncr() {
+    redis-cli del test_counter > /dev/null
+    res=`redis-cli rd_themis.cincr test_counter test_password`
+    assertEquals "1" "$res"
+    res=`redis-cli rd_themis.cincr test_counter test_password 41`
+    assertEquals "42" "$res"
+    res=`redis-cli rd_themis.cget test_counter test_password`
+    assertEquals "42" "$res"
+}
+
+test_Rd_Themis_CIncrB() {
+    res=`redis-cli rd_themis.cincr test_key test_password`
+    assertEquals "ERR value is not an integer or out of range" "$res"
+}
+
 test_Rd_Themis_CSetBl() {
     res=`redis-cli rd_themis.csetbl test_key test_password test_data`
     assertEquals "OK" "$res"
@@ -97,6 +134,154 @@ test_Rd_Themis_MsGetBlB3() {
     assertEquals "0" "$res"
 }
 
+test_Rd_Themis_MsSetMulti() {
+    res=`cat test/msset_multi_command | redis-cli`
+    assertEquals "OK" "$res"
+}
+
+test_Rd_Themis_MsGetMulti() {
+    res=`cat test/msget_multi_command | redis-cli`
+    assertEquals "test_data" "$res"
+}
+
+test_Rd_Themis_MsGetMulti2() {
+    res=`cat test/msget_multi_command_2 | redis-cli`
+    assertEquals "test_data" "$res"
+}
+
+test_Rd_Themis_MsGetMultiB() {
+    res=`cat test/msget_multi_command_b | redis-cli`
+    assertEquals "ERR secure message decryption failed" "$res"
+}
+
+test_Rd_Themis_CLPush() {
+    redis-cli del test_list > /dev/null
+    res=`redis-cli rd_themis.clpush test_list test_password test_data_1 test_data_2 test_data_3`
+    assertEquals "3" "$res"
+}
+
+test_Rd_Themis_CLRange() {
+    res=`redis-cli rd_themis.clrange test_list test_password 0 -1`
+    assertEquals "test_data_1
+test_data_2
+test_data_3" "$res"
+}
+
+test_Rd_Themis_CLRangeB() {
+    res=`redis-cli rd_themis.clrange test_list wrong_password 0 -1`
+    assertEquals "ERR secure seal decryption failed" "$res"
+}
+
+test_Rd_Themis_CLPushLong() {
+    redis-cli del test_long_list > /dev/null
+    res=`redis-cli rd_themis.clpush test_long_list test_password \`seq -f test_data_%g 100\``
+    assertEquals "100" "$res"
+}
+
+test_Rd_Themis_CLRangeLong() {
+    res=`redis-cli rd_themis.clrange test_long_list test_password 0 -1`
+    assertEquals "`seq -f test_data_%g 100`" "$res"
+}
+
+test_Rd_Themis_CLRangeLongB() {
+    res=`redis-cli rd_themis.clrange test_long_list wrong_password 0 -1`
+    assertEquals "ERR secure seal decryption failed" "$res"
+}
+
+test_Rd_Themis_CXAdd() {
+    redis-cli del test_stream > /dev/null
+    res=`redis-cli rd_themis.cxadd test_stream test_password 1-1 test_field test_data`
+    assertEquals "1-1" "$res"
+}
+
+test_Rd_Themis_CXRange() {
+    res=`redis-cli rd_themis.cxrange test_stream test_password - +`
+    assertEquals "1-1
+test_field
+test_data" "$res"
+}
+
+test_Rd_Themis_PSetNoKey() {
+    res=`redis-cli rd_themis.pset test_persist_key test_data`
+    assertEquals "ERR persistence_key is not configured" "$res"
+}
+
+persist_server_start() {
+    mkdir -p $1
+    redis-server --port 6391 --dir $1 --appendonly $2 --aof-use-rdb-preamble no --rdbcompression no --daemonize yes --loadmodule `pwd`/rd_themis.so persistence_key test_persistence_key persistence_replicate $3 > /dev/null
+    for i in `seq 50`; do
+        [ "`redis-cli -p 6391 ping 2>/dev/null`" = "PONG" ] && return
+        sleep 0.1
+    done
+}
+
+persist_server_stop() {
+    redis-cli -p 6391 shutdown nosave > /dev/null 2>&1
+    sleep 0.5
+}
+
+test_Rd_Themis_PSetReload() {
+    dir=`mktemp -d`
+    persist_server_start $dir/redis no no
+    head -c 200000 /dev/zero | tr '\0' 'p' > $dir/value
+    res=`redis-cli -p 6391 -x rd_themis.pset test_persist_key < $dir/value`
+    assertEquals "OK" "$res"
+    res=`redis-cli -p 6391 save`
+    assertEquals "OK" "$res"
+    persist_server_stop
+    grep -rq pppppppp $dir/redis
+    assertEquals 1 $?
+    persist_server_start $dir/redis no no
+    redis-cli -p 6391 --raw rd_themis.pget test_persist_key | head -c 200000 > $dir/loaded
+    cmp -s $dir/value $dir/loaded
+    assertEquals 0 $?
+    persist_server_stop
+    rm -rf $dir
+}
+
+test_Rd_Themis_PSetAof() {
+    dir=`mktemp -d`
+    persist_server_start $dir/redis yes yes
+    head -c 200000 /dev/zero | tr '\0' 'p' > $dir/value
+    redis-cli -p 6391 -x rd_themis.pset test_persist_key < $dir/value > /dev/null
+    redis-cli -p 6391 bgrewriteaof > /dev/null
+    for i in `seq 50`; do
+        redis-cli -p 6391 info persistence | grep -q 'aof_rewrite_in_progress:0' && break
+        sleep 0.1
+    done
+    redis-cli -p 6391 -x rd_themis.pset test_persist_key_2 < $dir/value > /dev/null
+    persist_server_stop
+    grep -rq pppppppp $dir/redis
+    assertEquals 1 $?
+    persist_server_start $dir/redis yes yes
+    redis-cli -p 6391 --raw rd_themis.pget test_persist_key | head -c 200000 > $dir/loaded
+    cmp -s $dir/value $dir/loaded
+    assertEquals 0 $?
+    redis-cli -p 6391 --raw rd_themis.pget test_persist_key_2 | head -c 200000 > $dir/loaded
+    cmp -s $dir/value $dir/loaded
+    assertEquals 0 $?
+    persist_server_stop
+    rm -rf $dir
+}
+
+test_Rd_Themis_PRestoreCrafted() {
+    dir=`mktemp -d`
+    persist_server_start $dir/redis no no
+    #zero chunks claiming the largest possible length
+    printf '\000\000\000\000\377\377\377\377\377\377\377\3770123456789abcdef' > $dir/crafted
+    res=`redis-cli -p 6391 -x rd_themis.prestore test_persist_key < $dir/crafted`
+    assertEquals "ERR persisted value can't be opened" "$res"
+    res=`redis-cli -p 6391 ping`
+    assertEquals "PONG" "$res"
+    persist_server_stop
+    rm -rf $dir
+}
+
+test_Rd_Themis_Stats() {
+    res=`redis-cli rd_themis.stats | head -1`
+    assertEquals "arena_mapped_bytes" "$res"
+}
+
 test_Unload_Rd_Themis_Module() {
     curdir=`pwd`
     res=`redis-cli module unload rd_themis`
@@ -0,0 +1,70 @@
+#
+# Copyright (c) 2016 Cossack Labs Limited
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+#!/bin/bash
+
+# Replays a mixed cset/cget/msset/msget workload against a throwaway
+# redis-server with the given module loaded and prints module size and
+# throughput. Used as PGO training run and for build comparison.
+#
+# usage: test/workload.sh path/to/rd_themis.so [requests]
+
+set -e
+
+module=`readlink -f $1`
+requests=${2:-20000}
+port=${WORKLOAD_PORT:-6390}
+workdir=`mktemp -d`
+# only the server started below writes the pidfile, never touch another one on $port
+trap '[ -f $workdir/redis.pid ] && kill `cat $workdir/redis.pid` 2> /dev/null; rm -rf $workdir' EXIT
+
+public_key='"\x55\x45\x43\x32\x00\x00\x00\x2d\x6b\xbb\x79\x79\x03\xfa\xb7\x33\x3a\x4d\x6e\xb7\xc2\x59\xde\x78\x96\xfa\x69\xe6\x63\x86\x91\xc2\x65\xa0\x92\xf6\x5a\x22\x3c\xa9\x8e\xc9\xa7\x35\x42"'
+private_key='"\x52\x45\x43\x32\x00\x00\x00\x2d\xc7\xa8\xca\x7a\x00\xc3\xb5\xd1\xad\x51\x37\x30\x8f\x45\xe6\x5e\x54\xdf\x2b\x7a\x45\xbc\x85\x08\xe8\xcc\x3b\xc9\x48\x1b\x63\x1a\xe8\x12\x8b\x39\x74"'
+small=`head -c 48 /dev/zero | tr '\0' 's'`
+large=`head -c 4096 /dev/zero | tr '\0' 'l'`
+
+# one request = cset, cget, msset, msget; every 8th request uses a 4KB payload
+for ((i=0; i<requests; i++)); do
+    data=$small
+    if (( i % 8 == 0 )); then
+        data=$large
+    fi
+    echo "rd_themis.cset cell:$i password $data"
+    echo "rd_themis.cget cell:$i password"
+    echo "rd_themis.msset msg:$i $public_key $data"
+    echo "rd_themis.msget msg:$i $private_key"
+done > $workdir/workload
+
+if redis-cli -p $port ping > /dev/null 2>&1; then
+    echo "port $port is already in use, set WORKLOAD_PORT" >&2
+    exit 1
+fi
+redis-server --port $port --dir $workdir --save "" --daemonize yes --pidfile $workdir/redis.pid --loadmodule $module > /dev/null
+for i in `seq 50`; do
+    redis-cli -p $port ping > /dev/null 2>&1 && break
+    sleep 0.1
+done
+if ! redis-cli -p $port ping > /dev/null 2>&1; then
+    echo "redis-server with $module did not start" >&2
+    exit 1
+fi
+
+start=`date +%s.%N`
+redis-cli -p $port --pipe < $workdir/workload > /dev/null
+end=`date +%s.%N`
+
+size=`stat -c %s $module`
+echo "$module: size $size bytes, $((requests*4)) commands in `echo "$end - $start" | bc` s, `echo "$requests*4 / ($end - $start)" | bc` ops/s"